@@ -0,0 +1,301 @@
+//[comment]
+// The benchmarks of the programs (--bench and --microbench) and their
+// regression checks: throughputs against a baseline and images against golden
+// images.
+//[/comment]
+#ifndef RAYTRACER_BENCHMARK_H
+#define RAYTRACER_BENCHMARK_H
+
+#include "raytracer.h"
+
+//[comment]
+// Nearest rank percentile of sorted samples
+//[/comment]
+inline double percentile(const std::vector<double> &sorted, double p)
+{
+    size_t rank = size_t(ceil(p / 100 * sorted.size()));
+    return sorted[std::min(sorted.size(), std::max(size_t(1), rank)) - 1];
+}
+
+//[comment]
+// Throughputs measured by the benchmarks: name of the scene or of the function
+// and the number of operations (rays, tests, calls) per second
+//[/comment]
+typedef std::vector<std::pair<std::string, double> > Throughputs;
+
+//[comment]
+// Print the statistics of a series of timings as a JSON object: mean, minimum,
+// maximum and the 50th, 90th and 99th percentiles.
+//[/comment]
+inline void printTimings(const char *name, std::vector<double> samples, const char *separator)
+{
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (size_t i = 0; i < samples.size(); ++i) sum += samples[i];
+    printf("        \"%s\": {\"mean\": %.6f, \"min\": %.6f, \"p50\": %.6f, \"p90\": %.6f, \"p99\": %.6f, \"max\": %.6f}%s\n",
+        name, sum / samples.size(), samples.front(), percentile(samples, 50), percentile(samples, 90), percentile(samples, 99), samples.back(),
+        separator);
+}
+
+//[comment]
+// Benchmark mode. Every scene is rendered iterations times with the render
+// options, and the timings of the phases of the frames are printed as JSON on
+// the standard output. The output phase converts and encodes the image in
+// memory but doesn't write it, to keep disk speed out of the measurements.
+// The number of rays per second counts the primary rays over the median render
+// time. Builds with RAYTRACER_STATS also print the ray counters of a frame.
+// The scenes can also be scene files (see loadScene()), each one is rendered
+// with its own camera and options.camera on top. Returns false if a scene
+// can't be loaded. program is the name of the program in the output. The rays
+// per second of the scenes are added to results.
+//[/comment]
+template<typename Material>
+bool benchmark(const std::vector<std::string> &scenes, unsigned iterations, const RenderOptions &options,
+    typename Material::Library &library, const char *program, Throughputs &results)
+{
+    for (size_t i = 0; i < scenes.size(); ++i) {
+        Scene<Material> scene;
+        if (!loadScene<Material>(scenes[i], library, scene) || !setCamera(options.camera, scene.camera)) return false;
+    }
+    WorkerPool pool(options.numThreads);
+    Framebuffer image;
+    std::vector<unsigned char> rgb, encoded;
+    printf("{\n    \"program\": \"%s\",\n    \"threads\": %u,\n"
+        "    \"kernel\": \"%s\",\n    \"packet\": %u,\n    \"wavefront\": %s,\n    \"accelerator\": \"%s\",\n"
+        "    \"cutoff\": %g,\n    \"iterations\": %u,\n    \"scenes\": [\n",
+        program, options.numThreads, kernelName(options.kernel), options.packetSize, options.wavefront ? "true" : "false",
+        options.accelerator == ACCELERATOR_AUTO ? "auto" : options.accelerator == ACCELERATOR_BVH ? "bvh" : "grid",
+        options.cutoff, iterations);
+    for (size_t i = 0; i < scenes.size(); ++i) {
+        Scene<Material> scene;
+        loadScene<Material>(scenes[i], library, scene);
+        setCamera(options.camera, scene.camera);
+        unsigned width = scene.camera.imageWidth(), height = scene.camera.imageHeight();
+        image.resize(width, height);
+        rgb.resize(size_t(width) * height * 3);
+        std::vector<double> setup, render, trace, shade, output, total;
+        RayCounters counters;
+        library.resetStats();
+        for (unsigned k = 0; k < iterations; ++k) {
+            RenderTimes times;
+            renderFrame(scene, scene.camera, options, pool, image.data(), &times, &counters, NULL);
+            Clock::time_point start = Clock::now();
+            quantize(image.data(), width * height, rgb.data());
+            encodeImage(options.format, rgb.data(), width, height, encoded);
+            times.output = seconds(start, Clock::now());
+            setup.push_back(times.setup);
+            render.push_back(times.render);
+            trace.push_back(times.trace);
+            shade.push_back(times.shade);
+            output.push_back(times.output);
+            total.push_back(times.setup + times.render + times.output);
+        }
+        std::vector<double> sorted(render);
+        std::sort(sorted.begin(), sorted.end());
+        printf("    {\n        \"name\": \"%s\",\n        \"spheres\": %zu,\n        \"width\": %u,\n"
+            "        \"height\": %u,\n        \"primaryRays\": %u,\n"
+            "        \"raysPerSecond\": %.0f,\n", scenes[i].c_str(), scene.spheres.size(), width, height, width * height,
+            width * height / percentile(sorted, 50));
+        results.push_back(std::make_pair(scenes[i], width * height / percentile(sorted, 50)));
+#ifdef RAYTRACER_STATS
+        printf("        \"counters\": {\"rays\": %llu, \"tests\": %llu, \"shadowRays\": %llu, \"maxDepth\": %u, "
+            "\"allRaysPerSecond\": %.0f},\n", (unsigned long long)counters.rays, (unsigned long long)counters.tests,
+            (unsigned long long)counters.shadowRays, counters.depth, (counters.rays + counters.shadowRays) / percentile(sorted, 50));
+#endif
+        std::string stats = library.stats();
+        if (!stats.empty()) printf("        %s,\n", stats.c_str());
+        printTimings("setup", setup, ",");
+        printTimings("render", render, ",");
+        printTimings("trace", trace, ",");
+        printTimings("shade", shade, ",");
+        printTimings("output", output, ",");
+        printTimings("total", total, "");
+        printf("    }%s\n", i + 1 < scenes.size() ? "," : "");
+    }
+    printf("    ]\n}\n");
+    return true;
+}
+
+//[comment]
+// Microbenchmarks of the inner loops: Sphere::intersect(), the intersection
+// kernel of the options on the same spheres, Math::normalize(),
+// Sphere::getColor() (with the materials of the program) and whole frames
+// (with options.camera on top of the default camera), all on the default
+// scene. The rays start at the origin and go through random points of the
+// default view. Every benchmark runs iterations times and keeps its fastest
+// run, and the operations per second are printed as JSON and added to results.
+// Returns false if the default scene can't be loaded.
+//[/comment]
+template<typename Material>
+bool microbenchmark(unsigned iterations, const RenderOptions &options, typename Material::Library &library,
+    const char *program, Throughputs &results)
+{
+    Scene<Material> scene;
+    if (!loadScene<Material>("default", library, scene) || !setCamera(options.camera, scene.camera)) return false;
+    const SphereArray<Material> &spheres = scene.spheres;
+    const unsigned RAYS = 4096, ROUNDS = 1024;
+    std::vector<Vec3f> directions(RAYS), rays(RAYS), points(RAYS);
+    for (unsigned i = 0; i < RAYS; ++i) {
+        directions[i] = rays[i] = Vec3f(drand48() * 0.8 - 0.4, drand48() * 0.6 - 0.3, -1);
+        rays[i].normalize();
+        // points on the surfaces of the spheres, for their colors
+        const Sphere<Material> &sphere = spheres[i % spheres.size()];
+        points[i] = sphere.center + rays[i] * sphere.radius;
+    }
+    SphereSoA geometry;
+    for (unsigned i = 0; i < spheres.size(); ++i) geometry.push(spheres[i], i);
+    geometry.pad();
+    volatile float sink = 0;                // keeps the results of the loops alive
+    const char *separator = "";
+    auto measure = [&](const char *name, const char *unit, double operations, const std::function<void()> &body) {
+        double best = INFINITY;
+        for (unsigned k = 0; k < iterations; ++k) {
+            Clock::time_point start = Clock::now();
+            body();
+            best = std::min(best, seconds(start, Clock::now()));
+        }
+        results.push_back(std::make_pair(std::string(name), operations / best));
+        printf("%s        {\"name\": \"%s\", \"%sPerSecond\": %.0f}", separator, name, unit, operations / best);
+        separator = ",\n";
+    };
+    printf("{\n    \"program\": \"%s\",\n    \"threads\": %u,\n    \"kernel\": \"%s\",\n    \"iterations\": %u,\n"
+        "    \"benchmarks\": [\n", program, options.numThreads, kernelName(options.kernel), iterations);
+    measure("sphereIntersect", "tests", double(ROUNDS) * RAYS * spheres.size(), [&] {
+        float sum = 0, thit;
+        for (unsigned r = 0; r < ROUNDS; ++r) {
+            for (unsigned i = 0; i < RAYS; ++i) {
+                for (unsigned k = 0; k < spheres.size(); ++k) {
+                    if (spheres[k].intersect(Vec3f(0), rays[i], thit)) sum += thit;
+                }
+            }
+        }
+        sink = sink + sum;
+    });
+    measure("intersectKernel", "tests", double(ROUNDS) * RAYS * spheres.size(), [&] {
+        float sum = 0, thit[SphereSoA::MAX_BATCH];
+        for (unsigned r = 0; r < ROUNDS; ++r) {
+            for (unsigned i = 0; i < RAYS; ++i) {
+                for (unsigned first = 0; first < geometry.size(); first += SphereSoA::MAX_BATCH) {
+                    unsigned count = std::min(geometry.size() - first, unsigned(SphereSoA::MAX_BATCH));
+                    for (unsigned mask = options.kernel(geometry, first, count, Vec3f(0), rays[i], thit); mask; mask &= mask - 1) {
+                        sum += thit[__builtin_ctz(mask)];
+                    }
+                }
+            }
+        }
+        sink = sink + sum;
+    });
+    measure("normalize", "calls", double(ROUNDS) * RAYS, [&] {
+        float sum = 0;
+        for (unsigned r = 0; r < ROUNDS; ++r) {
+            for (unsigned i = 0; i < RAYS; ++i) {
+                Vec3f d = directions[i];
+                Math::normalize(d);
+                sum += d.x;
+            }
+        }
+        sink = sink + sum;
+    });
+    measure("getColor", "calls", double(ROUNDS) * RAYS, [&] {
+        float sum = 0;
+        for (unsigned r = 0; r < ROUNDS; ++r) {
+            for (unsigned i = 0; i < RAYS; ++i) sum += spheres[i % spheres.size()].getColor(points[i], 0.002f).x;
+        }
+        sink = sink + sum;
+    });
+    WorkerPool pool(options.numThreads);
+    Framebuffer image;
+    unsigned width = scene.camera.imageWidth(), height = scene.camera.imageHeight();
+    image.resize(width, height);
+    measure("frame", "rays", double(width) * height, [&] {
+        renderFrame(scene, scene.camera, options, pool, image.data(), NULL, NULL, NULL);
+    });
+    printf("\n    ]\n}\n");
+    return true;
+}
+
+//[comment]
+// Throughput regression check: compare results with a baseline, the output of
+// an earlier --bench or --microbench run on the same machine, and print how
+// much every one of them changed. Results are matched by name, the throughput
+// of a name being the first number of operations per second after it. Returns
+// false, the check failing, if the baseline can't be read, has none of the
+// results or if a result is more than maxRegression (a fraction) below it.
+//[/comment]
+inline bool checkBaseline(const std::string &filename, const Throughputs &results, double maxRegression)
+{
+    std::ifstream file(filename.c_str());
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::map<std::string, double> baseline;
+    const std::string name = "\"name\": \"", rate = "PerSecond\": ";
+    for (size_t start = text.find(name); start != std::string::npos; start = text.find(name, start)) {
+        start += name.size();
+        size_t end = text.find('"', start), value = text.find(rate, start);
+        if (end == std::string::npos || value == std::string::npos) break;
+        baseline[text.substr(start, end - start)] = atof(text.c_str() + value + rate.size());
+    }
+    if (baseline.empty()) {
+        std::cerr << "Can't read baseline " << filename << std::endl;
+        return false;
+    }
+    bool passed = true, matched = false;
+    for (size_t i = 0; i < results.size(); ++i) {
+        std::map<std::string, double>::const_iterator it = baseline.find(results[i].first);
+        if (it == baseline.end() || it->second <= 0) {
+            std::cerr << results[i].first << ": not in the baseline" << std::endl;
+            continue;
+        }
+        double change = results[i].second / it->second - 1;
+        char line[256];
+        snprintf(line, sizeof(line), "%s: %.0f per second, baseline %.0f (%+.1f%%)%s", results[i].first.c_str(),
+            results[i].second, it->second, change * 100, change < -maxRegression ? ", regression" : "");
+        std::cerr << line << std::endl;
+        passed = passed && change >= -maxRegression;
+        matched = true;
+    }
+    if (!matched) std::cerr << "None of the results are in baseline " << filename << std::endl;
+    return passed && matched;
+}
+
+//[comment]
+// Golden image check: compare an image with a reference one (both binary PPM
+// files, see readImage()) and print their PSNR and the largest difference of
+// a sample. Returns false, the check failing, if the images can't be read or
+// aren't the same size, if the PSNR is below minPsnr (in dB) or if a sample
+// differs by more than maxError.
+//[/comment]
+inline bool compareImages(const std::string &filename, const std::string &golden, double minPsnr, unsigned maxError)
+{
+    std::vector<unsigned char> image, reference;
+    unsigned width, height, referenceWidth, referenceHeight;
+    if (!readImage(filename, image, width, height)) {
+        std::cerr << "Can't read image " << filename << std::endl;
+        return false;
+    }
+    if (!readImage(golden, reference, referenceWidth, referenceHeight)) {
+        std::cerr << "Can't read golden image " << golden << std::endl;
+        return false;
+    }
+    if (width != referenceWidth || height != referenceHeight) {
+        std::cerr << filename << " is " << width << "x" << height << ", golden image " << golden << " is " <<
+            referenceWidth << "x" << referenceHeight << std::endl;
+        return false;
+    }
+    double squares = 0;
+    unsigned largest = 0;
+    for (size_t i = 0; i < image.size(); ++i) {
+        unsigned difference = abs(int(image[i]) - int(reference[i]));
+        squares += difference * difference;
+        largest = std::max(largest, difference);
+    }
+    // no difference at all is an infinite PSNR
+    double psnr = squares ? 10 * log10(255. * 255 * image.size() / squares) : INFINITY;
+    bool passed = psnr >= minPsnr && largest <= maxError;
+    char line[256];
+    snprintf(line, sizeof(line), "%s: PSNR %.1f dB (minimum %.1f), max error %u (maximum %u) against %s%s",
+        filename.c_str(), psnr, minPsnr, largest, maxError, golden.c_str(), passed ? "" : ", failed");
+    std::cerr << line << std::endl;
+    return passed;
+}
+
+#endif
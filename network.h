@@ -0,0 +1,794 @@
+//[comment]
+// Distributed rendering (serve() and renderDistributed()) and previews
+// (preview() and view()) over TCP, on the platforms with sockets
+// (HAVE_SOCKETS, see raytracer.h). Without sockets, this header is empty.
+//[/comment]
+#ifndef RAYTRACER_NETWORK_H
+#define RAYTRACER_NETWORK_H
+
+#include "raytracer.h"
+
+#ifdef HAVE_SOCKETS
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+//[comment]
+// Distributed rendering. Worker processes (--serve PORT) render tiles of the
+// image for a coordinator (--workers HOST:PORT,...) over TCP. Every message is
+// a uint32_t type and a uint32_t payload size followed by the payload, all the
+// integers being little endian:
+//
+// - SETUP (coordinator to worker): the scene to load and the settings changing
+//   the image, as text lines "scene NAME", "camera SETTINGS" (see
+//   Camera::parse()), "cutoff X" and "packet N"
+// - READY (worker to coordinator): the region of the image the camera renders,
+//   x0, y0, x1 and y1 (or ERROR with the reason)
+// - TILE (coordinator to worker): x0, y0, x1 and y1 of a tile to render
+// - PIXELS (worker to coordinator): the tile, then its 8-bit RGB pixels
+//   compressed with rleEncode()
+//
+// A worker renders the tiles it is given one after the other with all its
+// threads, in the order they come. The threads, the kernel and the options of
+// the materials are the ones of the command line of the worker.
+//
+// The preview server (--preview PORT, see preview()) speaks the same messages
+// to its viewer: READY and the PIXELS of the whole image once connected, then
+// for every EDIT (viewer to server, an edit of the scene as text) the PIXELS of
+// the tiles which changed, followed by UPDATED (a summary as text) or ERROR.
+//[/comment]
+enum MessageType { MESSAGE_SETUP = 1, MESSAGE_READY, MESSAGE_ERROR, MESSAGE_TILE, MESSAGE_PIXELS, MESSAGE_EDIT, MESSAGE_UPDATED };
+
+const uint32_t MAX_MESSAGE_SIZE = 1 << 28;
+const int NETWORK_TIMEOUT = 120;            /// seconds coordinators and workers wait for a message of the other
+const unsigned REMOTE_TILE_SIZE = 64;       /// size of the tiles coordinators hand out, the largest workers render
+
+inline void put32(std::vector<unsigned char> &out, uint32_t v)
+{
+    for (int k = 0; k < 4; ++k) out.push_back(v >> (8 * k));
+}
+
+inline uint32_t get32(const unsigned char *p)
+{
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+//[comment]
+// Run length encoding of RGB pixels (PackBits over pixels instead of bytes). A
+// control byte n < 128 is followed by n + 1 pixels copied as they are, n >= 128
+// by one pixel repeated n - 126 times. The flat areas of an image (sky,
+// ground, the inside of the spheres) shrink to a few bytes.
+//[/comment]
+inline void rleEncode(const unsigned char *rgb, size_t numPixels, std::vector<unsigned char> &out)
+{
+    auto same = [&](size_t a, size_t b) { return !memcmp(rgb + 3 * a, rgb + 3 * b, 3); };
+    for (size_t i = 0; i < numPixels;) {
+        size_t run = 1;
+        while (i + run < numPixels && run < 129 && same(i, i + run)) ++run;
+        if (run >= 2) {
+            out.push_back(run + 126);
+            out.insert(out.end(), rgb + 3 * i, rgb + 3 * i + 3);
+            i += run;
+            continue;
+        }
+        // literal pixels, up to the next run
+        size_t count = 1;
+        while (i + count < numPixels && count < 128 && !(i + count + 1 < numPixels && same(i + count, i + count + 1))) ++count;
+        out.push_back(count - 1);
+        out.insert(out.end(), rgb + 3 * i, rgb + 3 * (i + count));
+        i += count;
+    }
+}
+
+//[comment]
+// Decode numPixels pixels encoded by rleEncode(). Returns false if the data
+// doesn't hold exactly that many pixels.
+//[/comment]
+inline bool rleDecode(const unsigned char *data, size_t size, unsigned char *rgb, size_t numPixels)
+{
+    size_t i = 0, k = 0;
+    while (k < size) {
+        unsigned n = data[k++];
+        if (n < 128) {
+            if (i + n + 1 > numPixels || 3 * (n + 1) > size - k) return false;
+            memcpy(rgb + 3 * i, data + k, 3 * (n + 1));
+            i += n + 1, k += 3 * (n + 1);
+        }
+        else {
+            if (i + n - 126 > numPixels || 3 > size - k) return false;
+            for (unsigned r = 0; r < n - 126; ++r, ++i) memcpy(rgb + 3 * i, data + k, 3);
+            k += 3;
+        }
+    }
+    return i == numPixels;
+}
+
+inline bool sendMessage(int fd, uint32_t type, const std::vector<unsigned char> &payload)
+{
+    std::vector<unsigned char> data;
+    put32(data, type);
+    put32(data, payload.size());
+    data.insert(data.end(), payload.begin(), payload.end());
+    for (size_t sent = 0; sent < data.size();) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, 0);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+inline bool receiveMessage(int fd, uint32_t &type, std::vector<unsigned char> &payload)
+{
+    auto receive = [&](unsigned char *p, size_t size) {
+        for (size_t got = 0; got < size;) {
+            ssize_t n = recv(fd, p + got, size - got, 0);
+            if (n <= 0) return false;
+            got += n;
+        }
+        return true;
+    };
+    unsigned char header[8];
+    if (!receive(header, sizeof(header))) return false;
+    type = get32(header);
+    uint32_t size = get32(header + 4);
+    if (size > MAX_MESSAGE_SIZE) return false;
+    payload.resize(size);
+    return receive(payload.data(), size);
+}
+
+inline void putTile(std::vector<unsigned char> &out, const Tile &tile)
+{
+    put32(out, tile.x0), put32(out, tile.y0), put32(out, tile.x1), put32(out, tile.y1);
+}
+
+inline Tile getTile(const unsigned char *p)
+{
+    Tile tile = { get32(p), get32(p + 4), get32(p + 8), get32(p + 12) };
+    return tile;
+}
+
+inline bool sameTile(const Tile &a, const Tile &b)
+{
+    return a.x0 == b.x0 && a.y0 == b.y0 && a.x1 == b.x1 && a.y1 == b.y1;
+}
+
+//[comment]
+// Open a connection to HOST:PORT. Returns -1, after printing why, if it fails.
+//[/comment]
+inline int connectTo(const std::string &address)
+{
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        std::cerr << "Invalid worker address " << address << ", expected HOST:PORT" << std::endl;
+        return -1;
+    }
+    std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+    addrinfo hints, *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses)) {
+        std::cerr << "Unknown worker host " << address << std::endl;
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo *a = addresses; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen)) close(fd), fd = -1;
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        std::cerr << "Can't connect to worker " << address << std::endl;
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    timeval timeout = { NETWORK_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+//[comment]
+// Listen for connections on port, from this machine only if local. Returns -1,
+// after printing why, if it fails.
+//[/comment]
+inline int listenOn(unsigned port, bool local)
+{
+    int listener = socket(AF_INET6, SOCK_STREAM, 0);
+    int one = 1, zero = 0;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    sockaddr_in6 address;
+    memset(&address, 0, sizeof(address));
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = local ? in6addr_loopback : in6addr_any;
+    address.sin6_port = htons(port);
+    if (local && listener >= 0) {
+        // ::1 only takes IPv6 connections, 127.0.0.1 is more common
+        close(listener);
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in address4;
+        memset(&address4, 0, sizeof(address4));
+        address4.sin_family = AF_INET;
+        address4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address4.sin_port = htons(port);
+        if (listener >= 0 && !bind(listener, reinterpret_cast<sockaddr*>(&address4), sizeof(address4)) && !listen(listener, 4))
+            return listener;
+    }
+    else if (listener >= 0 && !bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) && !listen(listener, 4)) {
+        return listener;
+    }
+    std::cerr << "Can't listen on port " << port << std::endl;
+    if (listener >= 0) close(listener);
+    return -1;
+}
+
+//[comment]
+// Load the scene a coordinator asks a worker for: one of the scenes of
+// buildScene(), or a scene file of sceneDir if the worker was given one. Scene
+// file names are relative to sceneDir and can't leave it, so coordinators
+// can't make the worker open any other file. Returns false if the scene can't
+// be loaded or isn't served.
+//[/comment]
+template<typename Material>
+bool loadServedScene(const std::string &name, const std::string &sceneDir, typename Material::Library &library,
+    Scene<Material> &scene)
+{
+    scene = Scene<Material>();
+    if (buildScene<Material>(name, library, scene.spheres)) return true;
+    if (sceneDir.empty() || name.empty() || name[0] == '/' || name.find('\\') != std::string::npos) return false;
+    for (size_t start = 0, end; start <= name.size(); start = end + 1) {
+        end = std::min(name.find('/', start), name.size());
+        if (!name.compare(start, end - start, "..")) return false;
+    }
+    return loadScene<Material>(sceneDir + "/" + name, library, scene);
+}
+
+//[comment]
+// Worker mode: wait for coordinators on port and render the tiles they send,
+// one coordinator at a time. Coordinators can render the generated scenes and
+// the scene files of sceneDir (see loadServedScene()), and are dropped if they
+// don't send anything for NETWORK_TIMEOUT seconds. The scene is only loaded
+// again (and its BVH built again) when a coordinator asks for another one.
+// Only returns if the port can't be listened on.
+//[/comment]
+template<typename Material>
+int serve(unsigned port, const RenderOptions &workerOptions, typename Material::Library &library,
+    const std::string &sceneDir)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int listener = listenOn(port, false);
+    if (listener < 0) return 1;
+    int one = 1;
+    std::cerr << "Waiting for coordinators on port " << port << std::endl;
+    WorkerPool pool(workerOptions.numThreads);
+    Scene<Material> scene;
+    std::string sceneName;
+    Camera sceneCamera;
+    std::unique_ptr<BVH<Material> > bvh;
+    std::vector<const Sphere<Material>*> lights;
+    Framebuffer framebuffer;
+    std::vector<unsigned char> rgb, payload;
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        // a coordinator which stalls doesn't keep the worker from the others
+        timeval timeout = { NETWORK_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        uint32_t type;
+        RenderOptions options = workerOptions;
+        Camera camera;
+        auto fail = [&](const std::string &reason) {
+            std::cerr << "Coordinator error: " << reason << std::endl;
+            sendMessage(fd, MESSAGE_ERROR, std::vector<unsigned char>(reason.begin(), reason.end()));
+        };
+        if (!receiveMessage(fd, type, payload) || type != MESSAGE_SETUP) {
+            fail("expected the setup");
+            close(fd);
+            continue;
+        }
+        // the settings of the coordinator
+        std::istringstream settings(std::string(payload.begin(), payload.end()));
+        std::string line, name, cameraSettings;
+        while (std::getline(settings, line)) {
+            size_t space = line.find(' ');
+            std::string key = line.substr(0, space), value = space == std::string::npos ? "" : line.substr(space + 1);
+            if (key == "scene") name = value;
+            else if (key == "camera") cameraSettings = value;
+            else if (key == "cutoff") options.cutoff = std::max(0., atof(value.c_str()));
+            else if (key == "packet") options.packetSize = atoi(value.c_str());
+        }
+        if (options.packetSize != 1 && options.packetSize != 4 && options.packetSize != 8) options.packetSize = 4;
+        if (name != sceneName || !bvh) {
+            std::cerr << "Loading scene " << name << std::endl;
+            bvh.reset();
+            sceneName.clear();
+            if (!loadServedScene<Material>(name, sceneDir, library, scene)) {
+                fail("can't load scene " + name);
+                close(fd);
+                continue;
+            }
+            sceneName = name;
+            sceneCamera = scene.camera;
+            bvh.reset(scene.nodes.empty() ? new BVH<Material>(scene.spheres, options.kernel) :
+                new BVH<Material>(scene.spheres, options.kernel, scene.nodes, scene.slots));
+            lights = findLights(scene.spheres);
+        }
+        camera = sceneCamera;
+        if (!setCamera(cameraSettings, camera)) {
+            fail("invalid camera settings");
+            close(fd);
+            continue;
+        }
+        Tile region = camera.region();
+        payload.clear();
+        putTile(payload, region);
+        if (!sendMessage(fd, MESSAGE_READY, payload)) {
+            close(fd);
+            continue;
+        }
+        unsigned tiles = 0;
+        while (receiveMessage(fd, type, payload)) {
+            if (type != MESSAGE_TILE || payload.size() != 16) {
+                fail("expected a tile");
+                break;
+            }
+            Tile tile = getTile(payload.data());
+            if (!(tile.x0 < tile.x1 && tile.y0 < tile.y1 && tile.x0 >= region.x0 && tile.y0 >= region.y0 &&
+                  tile.x1 <= region.x1 && tile.y1 <= region.y1)) {
+                fail("tile outside of the image");
+                break;
+            }
+            if (tile.x1 - tile.x0 > REMOTE_TILE_SIZE || tile.y1 - tile.y0 > REMOTE_TILE_SIZE) {
+                fail("tile too large");
+                break;
+            }
+            // the tile is a crop of the image, with the same pixels
+            camera.crop = tile;
+            size_t numPixels = size_t(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+            framebuffer.resize(tile.x1 - tile.x0, tile.y1 - tile.y0);
+            renderFrame(scene.spheres, lights, *bvh, camera, options, pool, framebuffer.data(), NULL, NULL, NULL);
+            rgb.resize(numPixels * 3);
+            quantize(framebuffer.data(), numPixels, rgb.data());
+            payload.clear();
+            putTile(payload, tile);
+            rleEncode(rgb.data(), numPixels, payload);
+            if (!sendMessage(fd, MESSAGE_PIXELS, payload)) break;
+            ++tiles;
+        }
+        std::cerr << "Rendered " << tiles << " tiles" << std::endl;
+        close(fd);
+    }
+}
+
+//[comment]
+// Coordinator mode: render scene (a scene name or file the workers can load)
+// with the workers at the addresses of workers and save the image like
+// render() does. The image is split into tiles of REMOTE_TILE_SIZE x
+// REMOTE_TILE_SIZE pixels which are handed out to the workers, each one having
+// up to 2 tiles to render so that it never waits for the next one. The tiles
+// of a worker which fails, disconnects or doesn't send anything for
+// NETWORK_TIMEOUT seconds while it has tiles are handed out again, and once
+// there is no tile left to hand out, the workers which are done get copies of
+// the tiles still being rendered, so a slow or stuck worker doesn't hold up
+// the image: the first copy rendered is kept. Returns false, after printing
+// why, if no worker could be used, they all failed or the image can't be
+// written.
+//[/comment]
+inline bool renderDistributed(const std::string &scene, const RenderOptions &options, const std::vector<std::string> &workers)
+{
+    const unsigned MAX_QUEUED = 2;
+    signal(SIGPIPE, SIG_IGN);
+    struct Remote
+    {
+        std::string address;
+        int fd;
+        std::deque<unsigned> queued;        /// tiles sent and not rendered yet, in order
+        unsigned rendered;
+        Clock::time_point heard;            /// last message, or tile given while it had none to render
+    };
+    std::vector<Remote> remotes;
+    std::ostringstream settings;
+    settings << "scene " << scene << "\ncamera " << options.camera << "\ncutoff " << options.cutoff <<
+        "\npacket " << options.packetSize << "\n";
+    std::string text = settings.str();
+    // the workers load the scene at the same time
+    for (unsigned i = 0; i < workers.size(); ++i) {
+        Remote remote = { workers[i], connectTo(workers[i]), std::deque<unsigned>(), 0, Clock::now() };
+        if (remote.fd < 0) continue;
+        if (!sendMessage(remote.fd, MESSAGE_SETUP, std::vector<unsigned char>(text.begin(), text.end()))) {
+            std::cerr << "Can't send the setup to worker " << workers[i] << std::endl;
+            close(remote.fd);
+            continue;
+        }
+        remotes.push_back(remote);
+    }
+    auto drop = [&](Remote &remote, const std::string &reason) {
+        std::cerr << "Dropping worker " << remote.address << ": " << reason << std::endl;
+        close(remote.fd);
+        remote.fd = -1;
+    };
+    Tile region = { 0, 0, 0, 0 };
+    bool ready = false;
+    std::vector<unsigned char> payload;
+    for (unsigned i = 0; i < remotes.size(); ++i) {
+        uint32_t type;
+        if (!receiveMessage(remotes[i].fd, type, payload)) {
+            drop(remotes[i], "no answer to the setup");
+            continue;
+        }
+        if (type != MESSAGE_READY || payload.size() != 16) {
+            drop(remotes[i], type == MESSAGE_ERROR ? std::string(payload.begin(), payload.end()) : "invalid answer");
+            continue;
+        }
+        Tile r = getTile(payload.data());
+        if (!ready) region = r, ready = true;
+        else if (!sameTile(r, region)) drop(remotes[i], "the image is not the same size");
+    }
+    if (!ready) {
+        std::cerr << "No worker to render with" << std::endl;
+        return false;
+    }
+    unsigned width = region.x1 - region.x0, height = region.y1 - region.y0;
+    std::vector<Tile> tiles = splitTiles(region, REMOTE_TILE_SIZE);
+    std::vector<unsigned> copies(tiles.size(), 0);
+    std::vector<bool> done(tiles.size(), false);
+    std::deque<unsigned> pending;
+    for (unsigned i = 0; i < tiles.size(); ++i) pending.push_back(i);
+    unsigned left = tiles.size();
+    std::vector<unsigned char> rgb(size_t(width) * height * 3), pixels;
+    // the tiles of a worker which failed go back to the ones to hand out
+    auto lost = [&](Remote &remote) {
+        for (unsigned k = 0; k < remote.queued.size(); ++k) {
+            unsigned t = remote.queued[k];
+            if (--copies[t] == 0 && !done[t]) pending.push_front(t);
+        }
+        remote.queued.clear();
+    };
+    // give a worker tiles until it has MAX_QUEUED of them, or a copy of a tile
+    // of another worker if it has none and there is no tile left to give
+    auto feed = [&](Remote &remote) {
+        while (remote.fd >= 0 && remote.queued.size() < MAX_QUEUED) {
+            while (!pending.empty() && done[pending.front()]) pending.pop_front();
+            unsigned t = ~0u;
+            if (!pending.empty()) {
+                t = pending.front();
+                pending.pop_front();
+            }
+            else if (remote.queued.empty()) {
+                for (unsigned i = 0; i < tiles.size(); ++i)
+                    if (!done[i] && (t == ~0u || copies[i] < copies[t])) t = i;
+            }
+            if (t == ~0u) return;
+            payload.clear();
+            putTile(payload, tiles[t]);
+            if (!sendMessage(remote.fd, MESSAGE_TILE, payload)) {
+                pending.push_front(t);
+                drop(remote, "can't send a tile");
+                lost(remote);
+                return;
+            }
+            if (remote.queued.empty()) remote.heard = Clock::now();
+            remote.queued.push_back(t);
+            ++copies[t];
+        }
+    };
+    for (unsigned i = 0; i < remotes.size(); ++i) feed(remotes[i]);
+    while (left) {
+        std::vector<pollfd> polled;
+        std::vector<unsigned> owners;
+        for (unsigned i = 0; i < remotes.size(); ++i) {
+            if (remotes[i].fd < 0) continue;
+            pollfd p = { remotes[i].fd, POLLIN, 0 };
+            polled.push_back(p);
+            owners.push_back(i);
+        }
+        if (polled.empty()) {
+            std::cerr << "All the workers failed, " << left << " tiles left" << std::endl;
+            return false;
+        }
+        int events = poll(polled.data(), polled.size(), NETWORK_TIMEOUT * 1000);
+        // the socket timeouts don't cover the wait for the pixels of a worker which went silent
+        bool silent = false;
+        for (unsigned i = 0; i < remotes.size(); ++i) {
+            if (remotes[i].fd < 0 || remotes[i].queued.empty() ||
+                seconds(remotes[i].heard, Clock::now()) < NETWORK_TIMEOUT) continue;
+            drop(remotes[i], "no answer");
+            lost(remotes[i]);
+            silent = true;
+        }
+        if (silent) {
+            for (unsigned i = 0; i < remotes.size(); ++i) feed(remotes[i]);
+            continue;
+        }
+        if (events <= 0) continue;
+        for (unsigned k = 0; k < polled.size(); ++k) {
+            if (!polled[k].revents) continue;
+            Remote &remote = remotes[owners[k]];
+            uint32_t type;
+            if (!receiveMessage(remote.fd, type, payload)) {
+                drop(remote, "connection lost");
+                lost(remote);
+                continue;
+            }
+            remote.heard = Clock::now();
+            // a worker renders its tiles in order
+            if (type != MESSAGE_PIXELS || payload.size() < 16 || remote.queued.empty() ||
+                !sameTile(getTile(payload.data()), tiles[remote.queued.front()])) {
+                drop(remote, type == MESSAGE_ERROR ? std::string(payload.begin(), payload.end()) : "unexpected message");
+                lost(remote);
+                continue;
+            }
+            unsigned t = remote.queued.front();
+            const Tile &tile = tiles[t];
+            unsigned w = tile.x1 - tile.x0, h = tile.y1 - tile.y0;
+            pixels.resize(size_t(w) * h * 3);
+            if (!rleDecode(payload.data() + 16, payload.size() - 16, pixels.data(), size_t(w) * h)) {
+                drop(remote, "invalid pixels");
+                lost(remote);
+                continue;
+            }
+            remote.queued.pop_front();
+            --copies[t];
+            ++remote.rendered;
+            if (!done[t]) {
+                for (unsigned y = 0; y < h; ++y)
+                    memcpy(&rgb[(size_t(tile.y0 - region.y0 + y) * width + tile.x0 - region.x0) * 3], &pixels[size_t(y) * w * 3], w * 3);
+                done[t] = true;
+                --left;
+            }
+            feed(remote);
+        }
+    }
+    for (unsigned i = 0; i < remotes.size(); ++i) {
+        if (remotes[i].fd < 0) continue;
+        std::cerr << "Worker " << remotes[i].address << ": " << remotes[i].rendered << " tiles" << std::endl;
+        close(remotes[i].fd);
+    }
+    if (!writeImage(options.output, options.format, rgb.data(), width, height)) {
+        std::cerr << "Can't write image " << options.output << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//[comment]
+// Apply an edit of the preview to the spheres of scene:
+//
+//     sphere INDEX [color R G B] [reflection X] [transparency X]
+//            [emission R G B] [center X Y Z] [radius R]
+//
+// Returns false, with the reason in error, if the edit is invalid, in which
+// case the scene is left as it was. geometry is set if the edit moves or
+// resizes the sphere, and index to the sphere edited.
+//[/comment]
+template<typename Material>
+bool applyEdit(const std::string &edit, Scene<Material> &scene, unsigned &index, bool &geometry, std::string &error)
+{
+    std::istringstream in(edit);
+    std::string keyword, setting;
+    if (!(in >> keyword) || keyword != "sphere" || !(in >> index) || index >= scene.spheres.size()) {
+        error = "expected sphere INDEX, the index of a sphere of the scene";
+        return false;
+    }
+    Sphere<Material> sphere = scene.spheres[index];
+    geometry = false;
+    while (in >> setting) {
+        bool ok;
+        if (setting == "color") ok = bool(in >> sphere.surfaceColor.x >> sphere.surfaceColor.y >> sphere.surfaceColor.z);
+        else if (setting == "reflection") ok = bool(in >> sphere.reflection);
+        else if (setting == "transparency") ok = bool(in >> sphere.transparency);
+        else if (setting == "emission") ok = bool(in >> sphere.emissionColor.x >> sphere.emissionColor.y >> sphere.emissionColor.z);
+        else if (setting == "center") ok = bool(in >> sphere.center.x >> sphere.center.y >> sphere.center.z), geometry = true;
+        else if (setting == "radius") {
+            ok = in >> sphere.radius && sphere.radius >= 0;
+            sphere.radius2 = sphere.radius * sphere.radius;
+            sphere.bind(sphere.radius);
+            geometry = true;
+        }
+        else ok = false;
+        if (!ok) {
+            error = "invalid setting " + setting;
+            return false;
+        }
+    }
+    scene.spheres[index] = sphere;
+    return true;
+}
+
+//[comment]
+// Preview mode, for look development: the scene, its BVH and the image stay in
+// memory while a viewer (see view()) connects to port on this machine and
+// sends edits of the spheres (see applyEdit()). Along with the color of every
+// pixel, the set of the spheres its ray tree touched is kept (see shade()), so
+// an edit of the color, reflection, transparency or emission of a sphere only
+// traces again the pixels which touched it. Moving or resizing a sphere refits
+// the BVH, and adding or removing a light changes the lighting everywhere, so
+// these trace all the pixels again. The tiles are sent to the viewer as soon
+// as they are done, and the image is the same as a render of the edited scene.
+// Viewers are served one at a time, and the edits stay for the next ones.
+//[/comment]
+template<typename Material>
+int preview(unsigned port, Scene<Material> &scene, const RenderOptions &options)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int listener = listenOn(port, true);
+    if (listener < 0) return 1;
+    SphereArray<Material> &spheres = scene.spheres;
+    PrimaryRays primaryRay(scene.camera);
+    const Tile &region = primaryRay.region;
+    std::unique_ptr<BVH<Material> > bvh(scene.nodes.empty() ? new BVH<Material>(spheres, options.kernel) :
+        new BVH<Material>(spheres, options.kernel, scene.nodes, scene.slots));
+    std::vector<const Sphere<Material>*> lights = findLights(spheres);
+    std::vector<Vec3f> image(size_t(region.x1 - region.x0) * (region.y1 - region.y0));
+    std::vector<uint64_t> touched(image.size(), 0);
+    std::vector<Tile> tiles = splitTiles(region, TILE_SIZE);
+    WorkerPool pool(options.numThreads);
+    int viewer = -1;
+    auto sendTile = [&](const Tile &tile, std::vector<unsigned char> &rgb, std::vector<unsigned char> &payload) {
+        unsigned w = tile.x1 - tile.x0;
+        rgb.resize(size_t(w) * (tile.y1 - tile.y0) * 3);
+        for (unsigned y = tile.y0; y < tile.y1; ++y)
+            quantize(&image[primaryRay.pixel(tile.x0, y)], w, &rgb[size_t(y - tile.y0) * w * 3]);
+        payload.clear();
+        putTile(payload, tile);
+        rleEncode(rgb.data(), rgb.size() / 3, payload);
+        // a viewer which went away is noticed when its next edit is read
+        if (viewer >= 0) sendMessage(viewer, MESSAGE_PIXELS, payload);
+    };
+    // trace the pixels whose ray tree touched a sphere of mask again (all of
+    // them if all is set), and send their tiles from another thread as they
+    // are done. Returns the number of pixels.
+    auto update = [&](uint64_t mask, bool all) {
+        std::vector<Tile> dirty;
+        for (unsigned t = 0; t < tiles.size(); ++t) {
+            bool found = all;
+            for (unsigned y = tiles[t].y0; y < tiles[t].y1 && !found; ++y)
+                for (unsigned x = tiles[t].x0; x < tiles[t].x1 && !found; ++x)
+                    found = touched[primaryRay.pixel(x, y)] & mask;
+            if (found) dirty.push_back(tiles[t]);
+        }
+        TileScheduler scheduler(dirty, pool.size());
+        TileQueue done(dirty.size());
+        std::future<void> sending = std::async(std::launch::async, [&]() {
+            std::vector<unsigned char> rgb, payload;
+            Tile tile;
+            while (done.pop(tile)) sendTile(tile, rgb, payload);
+        });
+        std::vector<size_t> traced(pool.size(), 0);
+        pool.run([&](unsigned id) {
+            Tile tile;
+            while (scheduler.next(id, tile)) {
+                for (unsigned y = tile.y0; y < tile.y1; ++y) {
+                    for (unsigned x = tile.x0; x < tile.x1; ++x) {
+                        size_t i = primaryRay.pixel(x, y);
+                        if (!all && !(touched[i] & mask)) continue;
+                        Random random(primaryRay.seed(x, y));
+                        touched[i] = 0;
+                        image[i] = trace(primaryRay.origin, primaryRay(x, y), lights, *bvh, options.cutoff, primaryRay.spread,
+                            random, &touched[i]);
+                        ++traced[id];
+                    }
+                }
+                done.push(tile);
+            }
+        });
+        sending.get();
+        size_t sum = 0;
+        for (unsigned i = 0; i < traced.size(); ++i) sum += traced[i];
+        return sum;
+    };
+    Clock::time_point start = Clock::now();
+    update(0, true);
+    std::cerr << "Rendered the scene in " << seconds(start, Clock::now()) << " s, waiting for viewers on port " <<
+        port << std::endl;
+    std::vector<unsigned char> payload, rgb;
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        viewer = fd;
+        payload.clear();
+        putTile(payload, region);
+        bool connected = sendMessage(viewer, MESSAGE_READY, payload);
+        for (unsigned t = 0; connected && t < tiles.size(); ++t) sendTile(tiles[t], rgb, payload);
+        std::string summary = "connected";
+        connected = connected && sendMessage(viewer, MESSAGE_UPDATED, std::vector<unsigned char>(summary.begin(), summary.end()));
+        uint32_t type;
+        while (connected && receiveMessage(viewer, type, payload)) {
+            std::string edit(payload.begin(), payload.end()), error;
+            unsigned index;
+            bool geometry;
+            bool wasLight = false, isLight = false;
+            if (type == MESSAGE_EDIT) {
+                unsigned i = 0;
+                std::istringstream in(edit);
+                std::string keyword;
+                if (in >> keyword >> i && i < spheres.size()) wasLight = spheres[i].emissionColor.x > 0;
+            }
+            if (type != MESSAGE_EDIT || !applyEdit(edit, scene, index, geometry, error)) {
+                if (type != MESSAGE_EDIT) error = "expected an edit";
+                connected = sendMessage(viewer, MESSAGE_ERROR, std::vector<unsigned char>(error.begin(), error.end()));
+                continue;
+            }
+            start = Clock::now();
+            isLight = spheres[index].emissionColor.x > 0;
+            if (geometry && !bvh->refit()) bvh.reset(new BVH<Material>(spheres, options.kernel));
+            if (isLight != wasLight) lights = findLights(spheres);
+            size_t traced = update(sphereBit(index), geometry || isLight != wasLight);
+            std::ostringstream out;
+            out << "traced " << traced << " pixels in " << seconds(start, Clock::now()) << " s";
+            summary = out.str();
+            std::cerr << edit << ": " << summary << std::endl;
+            connected = sendMessage(viewer, MESSAGE_UPDATED, std::vector<unsigned char>(summary.begin(), summary.end()));
+        }
+        viewer = -1;
+        close(fd);
+    }
+}
+
+//[comment]
+// Viewer of a preview server at address: the image is saved to options.output
+// every time it changes, and the edits (see applyEdit()) are read one per line
+// from the standard input. Returns false, after printing why, if the
+// connection fails.
+//[/comment]
+inline bool view(const std::string &address, const RenderOptions &options)
+{
+    int fd = connectTo(address);
+    if (fd < 0) return false;
+    std::vector<unsigned char> payload, pixels;
+    uint32_t type;
+    if (!receiveMessage(fd, type, payload) || type != MESSAGE_READY || payload.size() != 16) {
+        std::cerr << "Not a preview server: " << address << std::endl;
+        close(fd);
+        return false;
+    }
+    Tile region = getTile(payload.data());
+    unsigned width = region.x1 - region.x0, height = region.y1 - region.y0;
+    std::vector<unsigned char> rgb(size_t(width) * height * 3);
+    // read the tiles until the server is done with an edit
+    auto receive = [&]() {
+        while (receiveMessage(fd, type, payload)) {
+            if (type == MESSAGE_PIXELS && payload.size() >= 16) {
+                Tile tile = getTile(payload.data());
+                if (!(tile.x0 >= region.x0 && tile.y0 >= region.y0 && tile.x0 < tile.x1 && tile.y0 < tile.y1 &&
+                      tile.x1 <= region.x1 && tile.y1 <= region.y1)) break;
+                unsigned w = tile.x1 - tile.x0, h = tile.y1 - tile.y0;
+                pixels.resize(size_t(w) * h * 3);
+                if (!rleDecode(payload.data() + 16, payload.size() - 16, pixels.data(), size_t(w) * h)) break;
+                for (unsigned y = 0; y < h; ++y)
+                    memcpy(&rgb[(size_t(tile.y0 - region.y0 + y) * width + tile.x0 - region.x0) * 3], &pixels[size_t(y) * w * 3], w * 3);
+            }
+            else if (type == MESSAGE_UPDATED || type == MESSAGE_ERROR) {
+                std::cerr << (type == MESSAGE_ERROR ? "error: " : "") << std::string(payload.begin(), payload.end()) << std::endl;
+                if (type == MESSAGE_UPDATED && !writeImage(options.output, options.format, rgb.data(), width, height))
+                    std::cerr << "Can't write image " << options.output << std::endl;
+                return true;
+            }
+            else break;
+        }
+        std::cerr << "Lost the connection to " << address << std::endl;
+        return false;
+    };
+    bool connected = receive();
+    std::string line;
+    while (connected && std::getline(std::cin, line)) {
+        if (line.find_first_not_of(" \t") == std::string::npos) continue;
+        connected = sendMessage(fd, MESSAGE_EDIT, std::vector<unsigned char>(line.begin(), line.end())) && receive();
+    }
+    close(fd);
+    return connected;
+}
+#endif
+
+#endif
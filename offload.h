@@ -0,0 +1,263 @@
+//[comment]
+// The GPU offload of the renderer of raytracer.h, built with -DRAYTRACER_OFFLOAD
+// (see renderOffload()). Without the define, this header is empty.
+//[/comment]
+#ifndef RAYTRACER_OFFLOAD_H
+#define RAYTRACER_OFFLOAD_H
+
+#include "raytracer.h"
+
+#ifdef RAYTRACER_OFFLOAD
+#ifndef _OPENMP
+#error "RAYTRACER_OFFLOAD needs OpenMP (-fopenmp)"
+#endif
+#include <omp.h>
+
+//[comment]
+// GPU offload (builds with -DRAYTRACER_OFFLOAD and an OpenMP compiler which
+// offloads to the GPU, e.g. g++ -fopenmp -foffload=nvptx-none). The scene is
+// flattened to plain arrays: the nodes of the BVH, the SoA copy of the spheres
+// in slot order and one OffloadSphere per sphere for the shading. The arrays
+// are copied to the device, one device thread traces every pixel with the
+// shading model of shade() written as a loop over a small ray stack, and the
+// framebuffer is copied back.
+//
+// The results are the same as the ones of the CPU up to rounding (the device
+// has its own square roots and may fuse multiplies and adds). Textured
+// materials are not offloaded.
+//[/comment]
+struct OffloadSphere
+{
+    float center[3], radius2;
+    float color[3], reflection;
+    float emission[3], transparency;
+};
+
+struct OffloadRay
+{
+    float orig[3], dir[3], weight[3];
+    int depth;
+};
+
+#pragma omp declare target
+inline float offloadDot(const float *a, const float *b) { return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; }
+
+inline float offloadNormalize(float *v)
+{
+    float length = sqrtf(offloadDot(v, v));
+    if (length > 0) v[0] /= length, v[1] /= length, v[2] /= length;
+    return length;
+}
+
+//[comment]
+// Same as BVH::intersect() over the flattened BVH, returns the sphere hit or
+// ~0u.
+//[/comment]
+inline unsigned offloadIntersect(const BVHNode *nodes, const float *cx, const float *cy, const float *cz,
+    const float *radius2, const unsigned *slots, const float *o, const float *d, float tmax, bool any,
+    unsigned ignore, float &tnear)
+{
+    float invdir[3];
+    for (int a = 0; a < 3; ++a) invdir[a] = 1 / (fabsf(d[a]) > 1e-20f ? d[a] : copysignf(1e-20f, d[a]));
+    unsigned stack[64], sp = 0, sphere = ~0u;
+    tnear = tmax;
+    stack[sp++] = 0;
+    while (sp) {
+        const BVHNode &node = nodes[stack[--sp]];
+        float tx0 = (node.bmin.x - o[0]) * invdir[0], tx1 = (node.bmax.x - o[0]) * invdir[0];
+        float ty0 = (node.bmin.y - o[1]) * invdir[1], ty1 = (node.bmax.y - o[1]) * invdir[1];
+        float tz0 = (node.bmin.z - o[2]) * invdir[2], tz1 = (node.bmax.z - o[2]) * invdir[2];
+        float tmin = fmaxf(fmaxf(fminf(tx0, tx1), fminf(ty0, ty1)), fmaxf(fminf(tz0, tz1), 0.f));
+        float texit = fminf(fminf(fmaxf(tx0, tx1), fmaxf(ty0, ty1)), fminf(fmaxf(tz0, tz1), tnear));
+        if (tmin > texit) continue;
+        if (!node.count) {
+            stack[sp++] = node.first + 1;
+            stack[sp++] = node.first;
+            continue;
+        }
+        for (unsigned k = node.first; k < node.first + node.count; ++k) {
+            if (slots[k] == ~0u || slots[k] == ignore) continue;
+            float lx = cx[k] - o[0], ly = cy[k] - o[1], lz = cz[k] - o[2];
+            float tca = lx * d[0] + ly * d[1] + lz * d[2];
+            if (tca < 0) continue;
+            float d2 = lx * lx + ly * ly + lz * lz - tca * tca;
+            if (d2 > radius2[k]) continue;
+            // the stable roots of firstHit()
+            double ex = double(cx[k]) - o[0], ey = double(cy[k]) - o[1], ez = double(cz[k]) - o[2];
+            float c = float(ex * ex + ey * ey + ez * ez - radius2[k]);
+            float t1 = tca + sqrtf(fmaxf(0.f, tca * tca - c));
+            float t0 = t1 > 0 ? c / t1 : t1;
+            float t = t0 < 0 ? t1 : t0;
+            if (t < tnear || (t == tnear && slots[k] < sphere)) {
+                tnear = t;
+                sphere = slots[k];
+                if (any) return sphere;
+            }
+        }
+    }
+    return sphere;
+}
+#pragma omp end declare target
+
+//[comment]
+// Render the pixels of camera.region() in image on the GPU. Returns false,
+// after printing why, if the scene can't be rendered there (no device, or
+// textured spheres), for the caller to render it on the CPU instead.
+//[/comment]
+template<typename Material>
+bool renderOffload(const Scene<Material> &scene, const Camera &camera, const RenderOptions &options, Vec3f *image)
+{
+    if (Material::TEXTURED) {
+        std::cerr << "Textured spheres can't be offloaded, rendering on the CPU" << std::endl;
+        return false;
+    }
+    if (omp_get_num_devices() == 0) {
+        std::cerr << "No offload device, rendering on the CPU" << std::endl;
+        return false;
+    }
+    const SphereArray<Material> &spheres = scene.spheres;
+    if (spheres.empty()) return false;
+    BVH<Material> bvh = scene.nodes.empty() ? BVH<Material>(spheres, options.kernel) :
+        BVH<Material>(spheres, options.kernel, scene.nodes, scene.slots);
+    const std::vector<BVHNode> &nodes = bvh.treeNodes();
+    const std::vector<unsigned> &slots = bvh.slots();
+    std::vector<float> cx(slots.size()), cy(slots.size()), cz(slots.size()), radius2(slots.size(), -1);
+    for (size_t k = 0; k < slots.size(); ++k) {
+        if (slots[k] == ~0u) continue;
+        const Sphere<Material> &sphere = spheres[slots[k]];
+        cx[k] = sphere.center.x, cy[k] = sphere.center.y, cz[k] = sphere.center.z, radius2[k] = sphere.radius2;
+    }
+    std::vector<OffloadSphere> shading(spheres.size());
+    std::vector<unsigned> lights;
+    for (size_t i = 0; i < spheres.size(); ++i) {
+        const Sphere<Material> &sphere = spheres[i];
+        OffloadSphere &s = shading[i];
+        s.center[0] = sphere.center.x, s.center[1] = sphere.center.y, s.center[2] = sphere.center.z;
+        s.radius2 = sphere.radius2;
+        s.color[0] = sphere.surfaceColor.x, s.color[1] = sphere.surfaceColor.y, s.color[2] = sphere.surfaceColor.z;
+        s.emission[0] = sphere.emissionColor.x, s.emission[1] = sphere.emissionColor.y, s.emission[2] = sphere.emissionColor.z;
+        s.reflection = sphere.reflection, s.transparency = sphere.transparency;
+        if (sphere.emissionColor.x > 0) lights.push_back(i);
+    }
+    PrimaryRays primaryRay(camera);
+    Vec3f right, up, forward;
+    primaryRay.basis(right, up, forward);
+    const float basis[9] = { right.x, right.y, right.z, up.x, up.y, up.z, forward.x, forward.y, forward.z };
+    const float origin[3] = { primaryRay.origin.x, primaryRay.origin.y, primaryRay.origin.z };
+    const Tile region = primaryRay.region;
+    const unsigned regionWidth = region.x1 - region.x0, width = camera.width, numLights = lights.size();
+    const size_t numPixels = size_t(regionWidth) * (region.y1 - region.y0);
+    const size_t numNodes = nodes.size(), numSlots = slots.size(), numSpheres = spheres.size();
+    const BVHNode *n = nodes.data();
+    const unsigned *sl = slots.data(), *li = lights.data();
+    const float *px = cx.data(), *py = cy.data(), *pz = cz.data(), *pr = radius2.data();
+    const float *xs = primaryRay.columns().data(), *ys = primaryRay.rows().data();
+    const OffloadSphere *sh = shading.data();
+    const float cutoff = options.cutoff;
+    float *out = &image[0].x;
+    #pragma omp target teams distribute parallel for map(to: n[0:numNodes], sl[0:numSlots], px[0:numSlots], \
+        py[0:numSlots], pz[0:numSlots], pr[0:numSlots], sh[0:numSpheres], li[0:numLights], xs[0:camera.width], \
+        ys[0:camera.height], basis[0:9], origin[0:3]) map(from: out[0:3 * numPixels])
+    for (size_t p = 0; p < numPixels; ++p) {
+        unsigned x = region.x0 + p % regionWidth, y = region.y0 + p / regionWidth;
+        // the generator of Random
+        uint32_t state = (y * width + x) * 2654435761u ^ 0x9e3779b9u;
+        auto random = [&]() {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return (state >> 8) * (1 / 16777216.f);
+        };
+        state ^= state << 13, state ^= state >> 17, state ^= state << 5;
+        OffloadRay queue[2 * MAX_RAY_DEPTH + 2];
+        unsigned queued = 0;
+        float color[3] = { 0, 0, 0 };
+        OffloadRay ray;
+        for (int a = 0; a < 3; ++a) {
+            ray.orig[a] = origin[a];
+            ray.dir[a] = basis[a] * xs[x] + basis[3 + a] * ys[y] + basis[6 + a];
+            ray.weight[a] = 1;
+        }
+        offloadNormalize(ray.dir);
+        ray.depth = 0;
+        auto enqueue = [&](const float *orig, const float *dir, float *weight, int depth) {
+            float w = fmaxf(weight[0], fmaxf(weight[1], weight[2]));
+            if (!(w > 0)) return;
+            float scale = 1;
+            if (w < cutoff) {
+                if (random() * cutoff >= w) return;
+                scale = cutoff / w;
+            }
+            OffloadRay &next = queue[queued++];
+            for (int a = 0; a < 3; ++a) next.orig[a] = orig[a], next.dir[a] = dir[a], next.weight[a] = weight[a] * scale;
+            next.depth = depth;
+        };
+        for (;;) {
+            float tnear;
+            unsigned hit = offloadIntersect(n, px, py, pz, pr, sl, ray.orig, ray.dir, INFINITY, false, ~0u, tnear);
+            if (hit == ~0u) {
+                for (int a = 0; a < 3; ++a) color[a] += ray.weight[a] * 2;
+            }
+            else {
+                const OffloadSphere &sphere = sh[hit];
+                float phit[3], nhit[3];
+                for (int a = 0; a < 3; ++a) phit[a] = ray.orig[a] + ray.dir[a] * tnear, nhit[a] = phit[a] - sphere.center[a];
+                offloadNormalize(nhit);
+                const float bias = 1e-4;
+                bool inside = false;
+                if (offloadDot(ray.dir, nhit) > 0) {
+                    for (int a = 0; a < 3; ++a) nhit[a] = -nhit[a];
+                    inside = true;
+                }
+                if ((sphere.transparency > 0 || sphere.reflection > 0) && ray.depth < MAX_RAY_DEPTH) {
+                    float facingratio = -offloadDot(ray.dir, nhit);
+                    float f = 1 - facingratio, fresneleffect = 1 * 0.1f + f * f * f * (1 - 0.1f);
+                    float weight[3], next[3], orig[3];
+                    for (int a = 0; a < 3; ++a) weight[a] = ray.weight[a] * sphere.color[a];
+                    if (sphere.transparency) {
+                        float ior = 1.1, eta = inside ? ior : 1 / ior;
+                        float cosi = -offloadDot(nhit, ray.dir);
+                        float k = 1 - eta * eta * (1 - cosi * cosi);
+                        float w[3];
+                        for (int a = 0; a < 3; ++a) {
+                            next[a] = ray.dir[a] * eta + nhit[a] * (eta * cosi - sqrtf(k));
+                            orig[a] = phit[a] - nhit[a] * bias;
+                            w[a] = weight[a] * ((1 - fresneleffect) * sphere.transparency);
+                        }
+                        offloadNormalize(next);
+                        enqueue(orig, next, w, ray.depth + 1);
+                    }
+                    float cosine = offloadDot(ray.dir, nhit), w[3];
+                    for (int a = 0; a < 3; ++a) {
+                        next[a] = ray.dir[a] - nhit[a] * 2 * cosine;
+                        orig[a] = phit[a] + nhit[a] * bias;
+                        w[a] = weight[a] * fresneleffect;
+                    }
+                    offloadNormalize(next);
+                    enqueue(orig, next, w, ray.depth + 1);
+                }
+                else {
+                    float orig[3];
+                    for (int a = 0; a < 3; ++a) orig[a] = phit[a] + nhit[a] * bias;
+                    for (unsigned i = 0; i < numLights; ++i) {
+                        const OffloadSphere &light = sh[li[i]];
+                        float direction[3];
+                        for (int a = 0; a < 3; ++a) direction[a] = light.center[a] - phit[a];
+                        float distance = offloadNormalize(direction), cosine = offloadDot(nhit, direction), t;
+                        if (!(cosine > 0)) continue;
+                        if (offloadIntersect(n, px, py, pz, pr, sl, orig, direction, distance, true, li[i], t) != ~0u) continue;
+                        for (int a = 0; a < 3; ++a) color[a] += ray.weight[a] * sphere.color[a] * cosine * light.emission[a];
+                    }
+                }
+                for (int a = 0; a < 3; ++a) color[a] += ray.weight[a] * sphere.emission[a];
+            }
+            if (!queued) break;
+            ray = queue[--queued];
+        }
+        for (int a = 0; a < 3; ++a) out[3 * p + a] = color[a];
+    }
+    return true;
+}
+#endif
+
+#endif
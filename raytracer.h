@@ -0,0 +1,3546 @@
+//[comment]
+// The ray tracer of the tutorial, as a header-only library shared by
+// raytracer.cpp and angad_sphere_texture.cpp. Everything which depends on the
+// spheres is a template over a material policy (see FlatMaterial) choosing how
+// the color of a surface is computed, so each program gets its own copy of the
+// renderer specialized at compile time: raytracer uses flat colors and has no
+// texturing code at all, angad_sphere_texture uses TexturedMaterial (see
+// texture.h).
+//
+// This header is the renderer itself: the math, the acceleration structures,
+// the kernels, the scenes and their files, the images and render(). The rest
+// of the programs are in headers of their own: the GPU offload (offload.h),
+// distributed rendering and previews (network.h), the benchmarks and the
+// regression checks (benchmark.h), and the command line (run.h, which
+// includes the others).
+//[/comment]
+#ifndef RAYTRACER_H
+#define RAYTRACER_H
+
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <vector>
+#include <iostream>
+#include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+// writing this on fedora (linux) 
+
+
+#if defined __linux__ || defined __APPLE__
+#define HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_SOCKETS
+#else
+#define M_PI 3.141592653589793
+#define INFINITY 1e8 
+// these values not defined by default on windows
+#endif
+
+template<typename T>
+class Vec3
+{
+public:
+	T x, y, z ;
+	Vec3() : x(T(0)), y(T(0)), z(T(0)) {}
+	Vec3(T xx) : x(xx), y(xx), z(xx) {} 
+	Vec3(T xx, T yy, T zz) : x(xx), y(yy), z(zz) {}
+	Vec3& normalize() 
+	{
+		T nor2 = length2() ;
+		if (nor2 > 0) {
+			T invNor = 1 / sqrt(nor2) ;
+			x *= invNor, y *= invNor, z *= invNor ;
+		}
+		return *this ;
+	}
+    Vec3<T> operator * (const T &f) const { return Vec3<T>(x * f, y * f, z * f); }
+    Vec3<T> operator * (const Vec3<T> &v) const { return Vec3<T>(x * v.x, y * v.y, z * v.z); }
+    T dot(const Vec3<T> &v) const { return x * v.x + y * v.y + z * v.z; }
+    Vec3<T> cross(const Vec3<T> &v) const { return Vec3<T>(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x); }
+    Vec3<T> operator - (const Vec3<T> &v) const { return Vec3<T>(x - v.x, y - v.y, z - v.z); }
+    Vec3<T> operator + (const Vec3<T> &v) const { return Vec3<T>(x + v.x, y + v.y, z + v.z); }
+    Vec3<T>& operator += (const Vec3<T> &v) { x += v.x, y += v.y, z += v.z; return *this; }
+    Vec3<T>& operator *= (const Vec3<T> &v) { x *= v.x, y *= v.y, z *= v.z; return *this; }
+    Vec3<T> operator - () const { return Vec3<T>(-x, -y, -z); }
+    T length2() const { return x * x + y * y + z * z; }
+    T length() const { return sqrt(length2()); }
+    friend std::ostream & operator << (std::ostream &os, const Vec3<T> &v)
+    {
+        os << "[" << v.x << " " << v.y << " " << v.z << "]";
+        return os;
+    }
+};
+typedef Vec3<float> Vec3f;
+
+//[comment]
+// The material policy of the renderer. A material decides the color of a
+// sphere at a point of its surface, and Sphere derives from it, so a material
+// without data (like this one) takes no room in the spheres. It provides:
+//
+// - TEXTURED: whether color() uses the footprint of the ray, in which case the
+//   renderer tracks the ray cones needed to compute it (see RayCone)
+// - bind(radius): called once the radius of the sphere is known
+// - color(surfaceColor, hit, footprint): the color at hit (relative to the
+//   center of the sphere), footprint being the width of the ray there
+// - curvature(): the inverse of the radius, which widens the reflected cones
+// - textureFile(): the file the material was loaded from, saved in binary
+//   scene files (empty if none)
+// - Library: where the scene loaders get the materials from (get(textureFile)),
+//   which parses the command line options of the materials, and whose
+//   stats() (JSON fields, empty if none) the benchmark prints for every scene
+//   after resetStats(), and which is told the number of render threads
+//   (setThreads()) before it loads anything
+//
+// Materials must be trivially copyable, like the spheres, and refer to shared
+// data (such as textures) by pointer rather than owning it.
+//
+// FlatMaterial is the material of the tutorial: the color of a sphere is its
+// surface color, and the spheres have no textures.
+//[/comment]
+struct FlatMaterial
+{
+    enum { TEXTURED = 0 };
+    void bind(float) {}
+    Vec3f color(const Vec3f &surfaceColor, const Vec3f &, float) const { return surfaceColor; }
+    float curvature() const { return 0; }
+    std::string textureFile() const { return std::string(); }
+    //[comment]
+    // Nothing to load: the texture options of the scene files are ignored
+    //[/comment]
+    struct Library
+    {
+        FlatMaterial get(const std::string &) { return FlatMaterial(); }
+        bool parseOption(int, char **, int &, bool &) { return false; }
+        static const char* usage() { return ""; }
+        std::string stats() { return std::string(); }
+        void resetStats() {}
+        void setThreads(unsigned) {}
+    };
+};
+
+#if defined __GNUC__ && !defined __clang__
+#define EXACT_FP __attribute__((optimize("fp-contract=off")))
+#else
+#define EXACT_FP
+#endif
+
+//[comment]
+// Distance to the first intersection in front of the origin of a ray which
+// hits a sphere, tca being the distance along the ray to the point closest to
+// the center and c = |center - origin|^2 - radius^2 the term which only
+// depends on the origin. The roots are computed in the stable form
+// t1 = tca + sqrt(tca^2 - c), t0 = c / t1 rather than as tca -/+ sqrt(...),
+// which cancels out most of the digits of t0 on big spheres seen from close.
+//[/comment]
+inline EXACT_FP float firstHit(float c, float tca)
+{
+    float t1 = tca + std::sqrt(std::max(0.f, tca * tca - c));
+    float t0 = t1 > 0 ? c / t1 : t1;
+    return t0 < 0 ? t1 : t0;
+}
+
+//[comment]
+// Same as above, computing c for a sphere of center (cx, cy, cz). c is
+// computed in double: in float, center - origin is already off by the
+// rounding of the center, which for the ground sphere of the scenes (a 10000
+// radius) leaves t0 with 4 correct digits. The hit tests are done in float and
+// only the hits get there, so this costs little.
+//[/comment]
+inline EXACT_FP float firstHit(float cx, float cy, float cz, float radius2, const Vec3f &rayorig, float tca)
+{
+    double lx = double(cx) - rayorig.x, ly = double(cy) - rayorig.y, lz = double(cz) - rayorig.z;
+    return firstHit(float(lx * lx + ly * ly + lz * lz - radius2), tca);
+}
+
+//[comment]
+// A sphere is a plain record (it is trivially copyable): building a scene
+// copies spheres around as raw memory, with no reference counts or other
+// resources to take care of.
+//[/comment]
+template<typename Material>
+class Sphere : public Material
+{
+public:
+    Vec3f center;                           /// position of the sphere
+    float radius, radius2;                  /// sphere radius and radius^2
+    Vec3f surfaceColor, emissionColor;      /// surface color and emission (light)
+    float transparency, reflection;         /// surface transparency and reflectivity
+    Sphere(
+        const Vec3f &c,
+        const float &r,
+        const Vec3f &sc,
+        const float &refl = 0,
+        const float &transp = 0,
+        const Vec3f &ec = 0,
+        const Material &m = Material()) :
+        Material(m), center(c), radius(r), radius2(r * r), surfaceColor(sc), emissionColor(ec),
+        transparency(transp), reflection(refl)
+    {
+        Material::bind(r);
+    }
+    //[comment]
+    // Color of the surface at phit, footprint being the width of the ray there
+    //[/comment]
+    Vec3f getColor(const Vec3f &phit, float footprint) const
+    {
+        return Material::color(surfaceColor, phit - center, footprint);
+    }
+    //[comment]
+    // Compute a ray-sphere intersection using the geometric solution. thit is
+    // set to the distance to the first intersection in front of the ray
+    // origin (see firstHit()).
+    //[/comment]
+    EXACT_FP bool intersect(const Vec3f &rayorig, const Vec3f &raydir, float &thit) const
+    {
+        Vec3f l = center - rayorig;
+        float tca = l.dot(raydir);
+        if (tca < 0) return false;
+        float d2 = l.dot(l) - tca * tca;
+        if (d2 > radius2) return false;
+        thit = firstHit(center.x, center.y, center.z, radius2, rayorig, tca);
+        return true;
+    }
+};
+
+//[comment]
+// Allocator returning memory aligned on a cache line, so the SIMD kernels below
+// can use aligned loads
+//[/comment]
+template<typename T>
+struct AlignedAllocator
+{
+    typedef T value_type;
+    enum { ALIGNMENT = 64 };
+    AlignedAllocator() {}
+    template<typename U> AlignedAllocator(const AlignedAllocator<U> &) {}
+    T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(ALIGNMENT))); }
+    void deallocate(T *p, size_t) { ::operator delete(p, std::align_val_t(ALIGNMENT)); }
+    template<typename U> bool operator == (const AlignedAllocator<U> &) const { return true; }
+    template<typename U> bool operator != (const AlignedAllocator<U> &) const { return false; }
+};
+
+//[comment]
+// Memory of a scene, such as its spheres. Allocations are carved out of large
+// blocks and never freed one by one: the blocks are all released at once when
+// the arena is destroyed. Building a scene of a million spheres thus makes a
+// handful of allocations, and leaves no fragments behind it in the heap.
+// Allocations are aligned on a cache line.
+//[/comment]
+class Arena
+{
+public:
+    enum { BLOCK_SIZE = 1 << 20, ALIGNMENT = 64 };
+    Arena() : current(NULL), used(0), capacity(0) {}
+    ~Arena()
+    {
+        for (size_t i = 0; i < blocks.size(); ++i) ::operator delete(blocks[i], std::align_val_t(ALIGNMENT));
+    }
+    void* allocate(size_t size)
+    {
+        size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        // big allocations get a block of their own, so the rest of the
+        // current block isn't wasted
+        if (size > BLOCK_SIZE / 4) return newBlock(size);
+        if (size > capacity - used) {
+            current = newBlock(BLOCK_SIZE);
+            used = 0, capacity = BLOCK_SIZE;
+        }
+        void *p = current + used;
+        used += size;
+        return p;
+    }
+private:
+    char *current;                          /// block the small allocations are taken from
+    size_t used, capacity;
+    std::vector<char*> blocks;
+    char* newBlock(size_t size)
+    {
+        blocks.push_back(static_cast<char*>(::operator new(size, std::align_val_t(ALIGNMENT))));
+        return blocks.back();
+    }
+    Arena(const Arena &);
+    Arena& operator = (const Arena &);
+};
+
+//[comment]
+// Allocator taking its memory from an arena. Nothing is freed before the arena
+// goes away, so a container which grows leaves its previous buffers behind:
+// reserve the final size when it is known.
+//[/comment]
+template<typename T>
+struct ArenaAllocator
+{
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+    Arena *arena;
+    ArenaAllocator(Arena *a) : arena(a) {}
+    template<typename U> ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+    T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T))); }
+    void deallocate(T *, size_t) {}
+    template<typename U> bool operator == (const ArenaAllocator<U> &other) const { return arena == other.arena; }
+    template<typename U> bool operator != (const ArenaAllocator<U> &other) const { return arena != other.arena; }
+};
+
+//[comment]
+// The spheres of a scene, stored in the arena of the scene
+//[/comment]
+template<typename Material>
+using SphereArray = std::vector<Sphere<Material>, ArenaAllocator<Sphere<Material> > >;
+
+//[comment]
+// The pixels of a rendered image, in storage aligned on a cache line which is
+// kept from frame to frame: resize() only allocates when the image grows.
+//[/comment]
+class Framebuffer
+{
+public:
+    Framebuffer() : w(0), h(0) {}
+    void resize(unsigned width, unsigned height)
+    {
+        w = width, h = height;
+        if (pixels.size() < size_t(w) * h) pixels.resize(size_t(w) * h);
+    }
+    unsigned width() const { return w; }
+    unsigned height() const { return h; }
+    Vec3f* data() { return pixels.data(); }
+    const Vec3f* data() const { return pixels.data(); }
+private:
+    unsigned w, h;
+    std::vector<Vec3f, AlignedAllocator<Vec3f> > pixels;
+};
+
+//[comment]
+// Packed copy of the sphere geometry (structure of arrays). The intersection
+// kernels only need the center and the squared radius of the spheres, so these
+// are stored in separate aligned arrays and the colors and other shading data
+// stay out of the cache while we look for the closest hit. index[] maps each
+// slot back to its sphere in the scene.
+//
+// Spheres are stored in groups starting on a multiple of SphereSoA::WIDTH
+// slots; unused slots at the end of a group are never reported as hits.
+//[/comment]
+struct SphereSoA
+{
+    enum { WIDTH = 8, MAX_BATCH = 16 };
+    std::vector<float, AlignedAllocator<float> > cx, cy, cz, radius2;
+    std::vector<unsigned> index;
+    unsigned size() const { return index.size(); }
+    template<typename S>
+    void push(const S &sphere, unsigned i)
+    {
+        cx.push_back(sphere.center.x);
+        cy.push_back(sphere.center.y);
+        cz.push_back(sphere.center.z);
+        radius2.push_back(sphere.radius2);
+        index.push_back(i);
+    }
+    void pushEmpty()
+    {
+        cx.push_back(0), cy.push_back(0), cz.push_back(0), radius2.push_back(-1);
+        index.push_back(~0u);
+    }
+    void pad()
+    {
+        while (size() % WIDTH) pushEmpty();
+    }
+};
+
+//[comment]
+// Intersection kernels. A kernel tests the ray against count (at most
+// SphereSoA::MAX_BATCH) spheres stored from slot first, and returns a bit mask
+// of the spheres that are hit. For each hit, thit is set to the distance of the
+// first intersection in front of the ray origin (t0, or t1 if t0 is negative).
+// All the kernels do the same float operations as Sphere::intersect(), so they
+// return exactly the same hits, and compute the distance of the hits with
+// firstHit(). This only holds if the compiler does not fuse the multiplies and
+// adds (some x86 targets imply FMA), hence EXACT_FP.
+//[/comment]
+typedef unsigned (*IntersectKernel)(const SphereSoA &geometry, unsigned first, unsigned count,
+    const Vec3f &rayorig, const Vec3f &raydir, float *thit);
+
+inline EXACT_FP unsigned intersectScalar(const SphereSoA &geometry, unsigned first, unsigned count,
+    const Vec3f &rayorig, const Vec3f &raydir, float *thit)
+{
+    unsigned mask = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        unsigned k = first + i;
+        Vec3f l = Vec3f(geometry.cx[k], geometry.cy[k], geometry.cz[k]) - rayorig;
+        float tca = l.dot(raydir);
+        if (tca < 0) continue;
+        float d2 = l.dot(l) - tca * tca;
+        if (d2 > geometry.radius2[k]) continue;
+        thit[i] = firstHit(geometry.cx[k], geometry.cy[k], geometry.cz[k], geometry.radius2[k], rayorig, tca);
+        mask |= 1u << i;
+    }
+    return mask;
+}
+
+#if (defined __GNUC__ || defined __clang__) && (defined __x86_64__ || defined __i386__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+
+__attribute__((target("avx2"))) EXACT_FP
+inline unsigned intersectAVX2(const SphereSoA &geometry, unsigned first, unsigned count,
+    const Vec3f &rayorig, const Vec3f &raydir, float *thit)
+{
+    const __m256 ox = _mm256_set1_ps(rayorig.x), oy = _mm256_set1_ps(rayorig.y), oz = _mm256_set1_ps(rayorig.z);
+    const __m256 dx = _mm256_set1_ps(raydir.x), dy = _mm256_set1_ps(raydir.y), dz = _mm256_set1_ps(raydir.z);
+    const __m256 zero = _mm256_setzero_ps();
+    unsigned mask = 0;
+    // first is a multiple of the group width, so all the loads are aligned
+    for (unsigned i = 0; i < count; i += 8) {
+        unsigned k = first + i;
+        __m256 r2 = _mm256_load_ps(&geometry.radius2[k]);
+        __m256 lx = _mm256_sub_ps(_mm256_load_ps(&geometry.cx[k]), ox);
+        __m256 ly = _mm256_sub_ps(_mm256_load_ps(&geometry.cy[k]), oy);
+        __m256 lz = _mm256_sub_ps(_mm256_load_ps(&geometry.cz[k]), oz);
+        __m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, dx), _mm256_mul_ps(ly, dy)), _mm256_mul_ps(lz, dz));
+        __m256 l2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz));
+        __m256 d2 = _mm256_sub_ps(l2, _mm256_mul_ps(tca, tca));
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(tca, zero, _CMP_NLT_UQ), _mm256_cmp_ps(d2, r2, _CMP_NGT_UQ));
+        _mm256_storeu_ps(thit + i, tca);
+        mask |= unsigned(_mm256_movemask_ps(hit)) << i;
+    }
+    mask = count < 32 ? mask & ((1u << count) - 1) : mask;
+    // most tests miss, the distance of the few hits is computed one by one
+    for (unsigned m = mask; m; m &= m - 1) {
+        unsigned i = __builtin_ctz(m), k = first + i;
+        thit[i] = firstHit(geometry.cx[k], geometry.cy[k], geometry.cz[k], geometry.radius2[k], rayorig, thit[i]);
+    }
+    return mask;
+}
+
+__attribute__((target("avx512f"))) EXACT_FP
+inline unsigned intersectAVX512(const SphereSoA &geometry, unsigned first, unsigned count,
+    const Vec3f &rayorig, const Vec3f &raydir, float *thit)
+{
+    // masked loads, the group may end before the 16 lanes of a register
+    const __mmask16 lanes = __mmask16(count < 16 ? (1u << count) - 1 : 0xffff);
+    const __m512 zero = _mm512_setzero_ps();
+    __m512 r2 = _mm512_maskz_loadu_ps(lanes, &geometry.radius2[first]);
+    __m512 lx = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, &geometry.cx[first]), _mm512_set1_ps(rayorig.x));
+    __m512 ly = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, &geometry.cy[first]), _mm512_set1_ps(rayorig.y));
+    __m512 lz = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, &geometry.cz[first]), _mm512_set1_ps(rayorig.z));
+    __m512 tca = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(lx, _mm512_set1_ps(raydir.x)),
+        _mm512_mul_ps(ly, _mm512_set1_ps(raydir.y))), _mm512_mul_ps(lz, _mm512_set1_ps(raydir.z)));
+    __m512 l2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(lx, lx), _mm512_mul_ps(ly, ly)), _mm512_mul_ps(lz, lz));
+    __m512 d2 = _mm512_sub_ps(l2, _mm512_mul_ps(tca, tca));
+    __mmask16 hit = _mm512_mask_cmp_ps_mask(_mm512_cmp_ps_mask(tca, zero, _CMP_NLT_UQ), d2, r2, _CMP_NGT_UQ);
+    _mm512_storeu_ps(thit, tca);
+    unsigned mask = hit & lanes;
+    // most tests miss, the distance of the few hits is computed one by one
+    for (unsigned m = mask; m; m &= m - 1) {
+        unsigned i = __builtin_ctz(m), k = first + i;
+        thit[i] = firstHit(geometry.cx[k], geometry.cy[k], geometry.cz[k], geometry.radius2[k], rayorig, thit[i]);
+    }
+    return mask;
+}
+#endif
+
+//[comment]
+// Pick an intersection kernel by name ("scalar", "avx2", "avx512"), or the
+// widest one supported by this CPU for "auto". Returns NULL if the kernel is
+// unknown or not supported.
+//[/comment]
+inline IntersectKernel selectIntersectKernel(const std::string &name)
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    bool avx512 = __builtin_cpu_supports("avx512f"), avx2 = __builtin_cpu_supports("avx2");
+    if (name == "avx512" || (name == "auto" && avx512)) return avx512 ? intersectAVX512 : NULL;
+    if (name == "avx2" || (name == "auto" && avx2)) return avx2 ? intersectAVX2 : NULL;
+#endif
+    if (name == "scalar" || name == "auto") return intersectScalar;
+    return NULL;
+}
+
+inline const char* kernelName(IntersectKernel kernel)
+{
+#ifdef HAVE_X86_KERNELS
+    if (kernel == intersectAVX512) return "avx512";
+    if (kernel == intersectAVX2) return "avx2";
+#endif
+    return "scalar";
+}
+
+//[comment]
+// A bundle of primary rays sharing the same origin (the camera), traced through
+// the BVH together. A packet covers a square block of SIZE x SIZE pixels, the
+// lanes whose bit is clear in the active mask (pixels outside the tile) are
+// ignored. After BVH::intersect(), tnear and sphere give the closest hit of
+// each lane (sphere is ~0u if the ray hits nothing).
+//[/comment]
+template<unsigned SIZE>
+struct RayPacket
+{
+    enum { LANES = SIZE * SIZE };
+    Vec3f orig;
+    alignas(64) float dx[LANES];
+    alignas(64) float dy[LANES];
+    alignas(64) float dz[LANES];
+    alignas(64) float tnear[LANES];
+    alignas(64) unsigned sphere[LANES];
+    uint64_t active;
+};
+
+//[comment]
+// Optional instrumentation, compiled in with -DRAYTRACER_STATS. Every thread
+// counts the rays it traces (primary, reflection and refraction rays), the
+// ray-sphere intersection tests done in the BVH leaves, the shadow rays and the
+// depth of the deepest ray. Without RAYTRACER_STATS, COUNT() compiles to nothing
+// and the counters stay at 0.
+//[/comment]
+struct RayCounters
+{
+    uint64_t rays;                          /// primary, reflection and refraction rays traced
+    uint64_t tests;                         /// ray-sphere intersection tests
+    uint64_t shadowRays;                    /// shadow rays traced
+    unsigned depth;                         /// depth of the deepest ray
+};
+
+// zero-initialized, no constructor so accessing it doesn't need a guard
+inline thread_local RayCounters rayCounters;
+
+#ifdef RAYTRACER_STATS
+#define COUNT(statement) (void)(statement)
+#else
+#define COUNT(statement) ((void)0)
+#endif
+
+//[comment]
+// Axis-aligned bounding box, used to build the BVH
+//[/comment]
+struct AABB
+{
+    Vec3f bmin, bmax;
+    AABB() : bmin(INFINITY), bmax(-INFINITY) {}
+    void grow(const Vec3f &p)
+    {
+        bmin = Vec3f(std::min(bmin.x, p.x), std::min(bmin.y, p.y), std::min(bmin.z, p.z));
+        bmax = Vec3f(std::max(bmax.x, p.x), std::max(bmax.y, p.y), std::max(bmax.z, p.z));
+    }
+    void grow(const AABB &b) { if (b.bmin.x <= b.bmax.x) grow(b.bmin), grow(b.bmax); }
+    float area() const
+    {
+        if (bmin.x > bmax.x) return 0;
+        Vec3f e = bmax - bmin;
+        return e.x * e.y + e.y * e.z + e.z * e.x;
+    }
+};
+
+//[comment]
+// Box of a sphere for the accelerators, padded a little so rays grazing the
+// sphere are never culled because of rounding errors in the slab tests.
+//[/comment]
+template<typename Material>
+AABB sphereBounds(const Sphere<Material> &sphere)
+{
+    float pad = sphere.radius + 1e-5f * (sphere.radius + std::max(std::fabs(sphere.center.x),
+        std::max(std::fabs(sphere.center.y), std::fabs(sphere.center.z)))) + 1e-5f;
+    AABB b;
+    b.grow(sphere.center - Vec3f(pad));
+    b.grow(sphere.center + Vec3f(pad));
+    return b;
+}
+
+//[comment]
+// A node of a BVH as it is stored: the leaves index the slots of the SphereSoA,
+// and every slot holds the index of a sphere (or ~0u for the padding slots).
+//[/comment]
+struct BVHNode
+{
+    Vec3f bmin;
+    unsigned first;                         /// first child (interior) or first slot (leaf)
+    Vec3f bmax;
+    unsigned count;                         /// number of spheres, 0 for an interior node
+};
+
+//[comment]
+// Bounding volume hierarchy over the spheres of the scene. The tree is built top
+// down with the surface area heuristic (SAH) evaluated over a few bins per axis,
+// and is stored flattened in one contiguous array of nodes: the two children of
+// an interior node are stored next to each other, and a leaf references a range
+// of the sphere index array.
+//
+// Once built, the spheres of each leaf are copied to a SphereSoA in tree order
+// and the leaves are tested with one of the SIMD kernels above. The kernels
+// return the same hits as Sphere::intersect(), so the result of a query is the
+// same as the one of a linear scan over all the spheres (including which sphere
+// wins when two hits are at the same distance).
+//[/comment]
+template<typename Material>
+class BVH
+{
+public:
+    BVH(const SphereArray<Material> &s, IntersectKernel k) : spheres(s), kernel(k)
+    {
+        for (unsigned i = 0; i < spheres.size(); ++i) indices.push_back(i);
+        nodes.reserve(2 * spheres.size() + 1);
+        nodes.push_back(Node());
+        nodes[0].first = 0;
+        nodes[0].count = spheres.size();
+        build(0, 0);
+        // copy the geometry of the leaves to the SoA store, each leaf
+        // starting a new group of slots
+        for (unsigned n = 0; n < nodes.size(); ++n) {
+            if (!nodes[n].count) continue;
+            geometry.pad();
+            unsigned first = geometry.size();
+            for (unsigned k = nodes[n].first; k < nodes[n].first + nodes[n].count; ++k)
+                geometry.push(spheres[indices[k]], indices[k]);
+            nodes[n].first = first;
+        }
+        geometry.pad();
+        std::vector<unsigned>().swap(indices);
+        builtArea = area();
+    }
+    typedef BVHNode Node;
+    const std::vector<Node>& treeNodes() const { return nodes; }
+    unsigned indexOf(const Sphere<Material> *sphere) const { return unsigned(sphere - &spheres[0]); }
+    const std::vector<unsigned>& slots() const { return geometry.index; }
+    AABB bounds() const
+    {
+        AABB box;
+        if (!spheres.empty()) box.bmin = nodes[0].bmin, box.bmax = nodes[0].bmax;
+        return box;
+    }
+    //[comment]
+    // Rebuild a BVH from the nodes and slots of a BVH built over the same spheres
+    // (see saveBinaryScene()), which is much faster than building it again.
+    //[/comment]
+    BVH(const SphereArray<Material> &s, IntersectKernel k, const std::vector<Node> &n, const std::vector<unsigned> &slots) :
+        spheres(s), kernel(k), nodes(n)
+    {
+        for (unsigned i = 0; i < slots.size(); ++i) {
+            if (slots[i] == ~0u) geometry.pushEmpty();
+            else geometry.push(spheres[slots[i]], slots[i]);
+        }
+        builtArea = area();
+    }
+    //[comment]
+    // Refit the BVH to spheres which moved: the SoA copy of the geometry and the
+    // boxes are updated bottom up and the tree is kept as it is, which is much
+    // faster than building it again. The tree gets worse as the spheres move
+    // away from where they were when it was built, so this returns false once
+    // the total area of the boxes (what the queries cost, see build()) is more
+    // than twice what it was, for the caller to build a new one.
+    //[/comment]
+    bool refit()
+    {
+        if (spheres.empty()) return true;
+        for (unsigned k = 0; k < geometry.size(); ++k) {
+            unsigned i = geometry.index[k];
+            if (i == ~0u) continue;
+            geometry.cx[k] = spheres[i].center.x;
+            geometry.cy[k] = spheres[i].center.y;
+            geometry.cz[k] = spheres[i].center.z;
+            geometry.radius2[k] = spheres[i].radius2;
+        }
+        // the children of a node are stored after it
+        for (unsigned n = nodes.size(); n-- > 0;) {
+            Node &node = nodes[n];
+            AABB box;
+            if (node.count) {
+                for (unsigned k = node.first; k < node.first + node.count; ++k)
+                    if (geometry.index[k] != ~0u) box.grow(bounds(spheres[geometry.index[k]]));
+            }
+            else {
+                for (unsigned c = node.first; c < node.first + 2; ++c)
+                    box.grow(nodes[c].bmin), box.grow(nodes[c].bmax);
+            }
+            node.bmin = box.bmin;
+            node.bmax = box.bmax;
+        }
+        return area() <= 2 * builtArea;
+    }
+    //[comment]
+    // Check that nodes and slots (read from a file) form a tree the queries can
+    // traverse safely: children stored after their parent, leaves starting on
+    // a group of slots, no deeper than MAX_DEPTH, every slot a sphere or empty.
+    //[/comment]
+    static bool valid(const std::vector<Node> &nodes, const std::vector<unsigned> &slots, unsigned numSpheres)
+    {
+        if (nodes.empty() || slots.size() % SphereSoA::WIDTH) return false;
+        for (unsigned i = 0; i < slots.size(); ++i)
+            if (slots[i] != ~0u && slots[i] >= numSpheres) return false;
+        std::vector<unsigned> depth(nodes.size(), 0);
+        for (unsigned n = 0; n < nodes.size(); ++n) {
+            const Node &node = nodes[n];
+            if (node.count) {
+                if (node.first % SphereSoA::WIDTH || node.first > slots.size() || node.count > slots.size() - node.first)
+                    return false;
+            }
+            else {
+                if (node.first <= n || node.first + 1 >= nodes.size() || depth[n] + 1 >= MAX_DEPTH) return false;
+                depth[node.first] = depth[node.first + 1] = depth[n] + 1;
+            }
+        }
+        return true;
+    }
+    //[comment]
+    // Find the sphere closest to the ray origin. Returns NULL if there is no hit,
+    // otherwise tnear is set to the distance to the intersection point.
+    //[/comment]
+    const Sphere<Material>* intersect(const Vec3f &rayorig, const Vec3f &raydir, float &tnear) const
+    {
+        unsigned sphere = ~0u;
+        tnear = INFINITY;
+        if (spheres.empty()) return NULL;
+        Vec3f invdir = inverse(raydir);
+        unsigned stack[MAX_DEPTH];
+        unsigned sp = 0, n = 0;
+        if (enter(nodes[0], rayorig, invdir, tnear) == INFINITY) return NULL;
+        for (;;) {
+            const Node &node = nodes[n];
+            if (node.count) {
+                for (unsigned k = node.first; k < node.first + node.count; k += SphereSoA::MAX_BATCH) {
+                    float thit[SphereSoA::MAX_BATCH];
+                    unsigned batch = std::min(unsigned(SphereSoA::MAX_BATCH), node.first + node.count - k);
+                    COUNT(rayCounters.tests += batch);
+                    for (unsigned mask = kernel(geometry, k, batch, rayorig, raydir, thit); mask; mask &= mask - 1) {
+                        unsigned i = lowestBit(mask), candidate = geometry.index[k + i];
+                        if (thit[i] < tnear || (thit[i] == tnear && candidate < sphere)) {
+                            tnear = thit[i];
+                            sphere = candidate;
+                        }
+                    }
+                }
+            }
+            else {
+                // visit the closest child first, the other one might then be culled
+                unsigned near = node.first, far = node.first + 1;
+                float tn = enter(nodes[near], rayorig, invdir, tnear);
+                float tf = enter(nodes[far], rayorig, invdir, tnear);
+                if (tf < tn) std::swap(near, far), std::swap(tn, tf);
+                if (tn != INFINITY) {
+                    if (tf != INFINITY) stack[sp++] = far;
+                    n = near;
+                    continue;
+                }
+            }
+            // pop the next node which can still hold a closer hit
+            for (;;) {
+                if (sp == 0) return sphere == ~0u ? NULL : &spheres[sphere];
+                n = stack[--sp];
+                if (enter(nodes[n], rayorig, invdir, tnear) != INFINITY) break;
+            }
+        }
+    }
+    //[comment]
+    // Returns true if the ray intersects any sphere other than ignore closer than
+    // tmax. This is the test used for shadow rays, with tmax the distance to the
+    // light so that the spheres behind the light don't cast shadows. It stops at
+    // the first sphere that is hit.
+    //[/comment]
+    bool occluded(const Vec3f &rayorig, const Vec3f &raydir, float tmax, const Sphere<Material>* ignore) const
+    {
+        COUNT(++rayCounters.shadowRays);
+        if (spheres.empty()) return false;
+        unsigned skip = ignore ? unsigned(ignore - &spheres[0]) : ~0u;
+        Vec3f invdir = inverse(raydir);
+        unsigned stack[MAX_DEPTH + 1];
+        unsigned sp = 0;
+        stack[sp++] = 0;
+        while (sp) {
+            const Node &node = nodes[stack[--sp]];
+            if (enter(node, rayorig, invdir, tmax) == INFINITY) continue;
+            if (node.count) {
+                for (unsigned k = node.first; k < node.first + node.count; k += SphereSoA::MAX_BATCH) {
+                    float thit[SphereSoA::MAX_BATCH];
+                    unsigned batch = std::min(unsigned(SphereSoA::MAX_BATCH), node.first + node.count - k);
+                    COUNT(rayCounters.tests += batch);
+                    for (unsigned mask = kernel(geometry, k, batch, rayorig, raydir, thit); mask; mask &= mask - 1) {
+                        unsigned i = lowestBit(mask);
+                        if (thit[i] < tmax && geometry.index[k + i] != skip) return true;
+                    }
+                }
+            }
+            else {
+                stack[sp++] = node.first + 1;
+                stack[sp++] = node.first;
+            }
+        }
+        return false;
+    }
+    //[comment]
+    // Closest hit for all the rays of a packet. A node is visited if any active
+    // ray of the packet may hit its box before its current closest hit, and
+    // since all the rays share the same origin, the part of the hit test which
+    // only depends on the sphere (the vector to its center, its squared length
+    // and the c of firstHit()) is computed once for the whole packet. Each lane
+    // then gets the same hit as a single ray traced with intersect() above.
+    //[/comment]
+    template<unsigned SIZE>
+    EXACT_FP void intersect(RayPacket<SIZE> &packet) const
+    {
+        enum { LANES = RayPacket<SIZE>::LANES };
+        alignas(64) float ix[LANES], iy[LANES], iz[LANES];
+        for (unsigned i = 0; i < LANES; ++i) {
+            Vec3f invdir = inverse(Vec3f(packet.dx[i], packet.dy[i], packet.dz[i]));
+            ix[i] = invdir.x, iy[i] = invdir.y, iz[i] = invdir.z;
+            packet.tnear[i] = INFINITY;
+            packet.sphere[i] = ~0u;
+        }
+        if (spheres.empty() || !packet.active) return;
+        const Vec3f &o = packet.orig;
+        unsigned stack[MAX_DEPTH + 1];
+        unsigned sp = 0;
+        stack[sp++] = 0;
+        while (sp) {
+            const Node &node = nodes[stack[--sp]];
+            // lanes which enter the box before their closest hit
+            uint64_t mask = 0;
+            for (unsigned i = 0; i < LANES; ++i) {
+                float tx0 = (node.bmin.x - o.x) * ix[i], tx1 = (node.bmax.x - o.x) * ix[i];
+                float ty0 = (node.bmin.y - o.y) * iy[i], ty1 = (node.bmax.y - o.y) * iy[i];
+                float tz0 = (node.bmin.z - o.z) * iz[i], tz1 = (node.bmax.z - o.z) * iz[i];
+                float tmin = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), float(0)));
+                float tmax = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), packet.tnear[i]));
+                mask |= uint64_t(tmin <= tmax) << i;
+            }
+            mask &= packet.active;
+            if (!mask) continue;
+            if (node.count) {
+                COUNT(rayCounters.tests += node.count * std::bitset<64>(mask).count());
+                for (unsigned k = node.first; k < node.first + node.count; ++k) {
+                    Vec3f l = Vec3f(geometry.cx[k], geometry.cy[k], geometry.cz[k]) - o;
+                    float l2 = l.dot(l), radius2 = geometry.radius2[k];
+                    double cx = double(geometry.cx[k]) - o.x, cy = double(geometry.cy[k]) - o.y, cz = double(geometry.cz[k]) - o.z;
+                    float c = float(cx * cx + cy * cy + cz * cz - radius2);
+                    unsigned index = geometry.index[k];
+                    // rays which missed the box cannot hit the sphere
+                    for (uint64_t m = mask; m; m &= m - 1) {
+                        unsigned i = lowestBit(m);
+                        float tca = l.x * packet.dx[i] + l.y * packet.dy[i] + l.z * packet.dz[i];
+                        if (tca < 0) continue;
+                        float d2 = l2 - tca * tca;
+                        if (d2 > radius2) continue;
+                        float t = firstHit(c, tca);
+                        if (t < packet.tnear[i] || (t == packet.tnear[i] && index < packet.sphere[i])) {
+                            packet.tnear[i] = t;
+                            packet.sphere[i] = index;
+                        }
+                    }
+                }
+            }
+            else {
+                // the rays start from the same point: visit the child whose box
+                // center is the closest to it first
+                const Node &left = nodes[node.first], &right = nodes[node.first + 1];
+                Vec3f cl = (left.bmin + left.bmax) * 0.5f - o, cr = (right.bmin + right.bmax) * 0.5f - o;
+                bool leftFirst = cl.length2() < cr.length2();
+                stack[sp++] = leftFirst ? node.first + 1 : node.first;
+                stack[sp++] = leftFirst ? node.first : node.first + 1;
+            }
+        }
+    }
+private:
+    enum { NUM_BINS = 16, MAX_LEAF_SIZE = 8, MAX_DEPTH = 64 };
+    static AABB bounds(const Sphere<Material> &sphere) { return sphereBounds(sphere); }
+    static Vec3f inverse(const Vec3f &d)
+    {
+        // avoid (0 * inf) in the slab test for axis aligned rays
+        return Vec3f(1 / (std::fabs(d.x) > 1e-20f ? d.x : std::copysign(1e-20f, d.x)),
+                     1 / (std::fabs(d.y) > 1e-20f ? d.y : std::copysign(1e-20f, d.y)),
+                     1 / (std::fabs(d.z) > 1e-20f ? d.z : std::copysign(1e-20f, d.z)));
+    }
+    static unsigned lowestBit(uint64_t mask)
+    {
+#if defined __GNUC__ || defined __clang__
+        return __builtin_ctzll(mask);
+#else
+        unsigned i = 0;
+        while (!(mask >> i & 1)) ++i;
+        return i;
+#endif
+    }
+    static float axis(const Vec3f &v, int a) { return a == 0 ? v.x : (a == 1 ? v.y : v.z); }
+    //[comment]
+    // Slab test. Returns the distance at which the ray enters the box, or INFINITY
+    // if the ray misses the box within [0, tmax].
+    //[/comment]
+    static float enter(const Node &node, const Vec3f &o, const Vec3f &invdir, float tmax)
+    {
+        float tx0 = (node.bmin.x - o.x) * invdir.x, tx1 = (node.bmax.x - o.x) * invdir.x;
+        float ty0 = (node.bmin.y - o.y) * invdir.y, ty1 = (node.bmax.y - o.y) * invdir.y;
+        float tz0 = (node.bmin.z - o.z) * invdir.z, tz1 = (node.bmax.z - o.z) * invdir.z;
+        float tmin = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), float(0)));
+        tmax = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), tmax));
+        return tmin <= tmax ? tmin : INFINITY;
+    }
+    void build(unsigned n, unsigned depth)
+    {
+        unsigned first = nodes[n].first, count = nodes[n].count;
+        AABB box, centroids;
+        for (unsigned k = first; k < first + count; ++k) {
+            box.grow(bounds(spheres[indices[k]]));
+            centroids.grow(spheres[indices[k]].center);
+        }
+        nodes[n].bmin = box.bmin;
+        nodes[n].bmax = box.bmax;
+        if (count <= 1 || depth + 1 >= MAX_DEPTH) return;
+        // find the cheapest split plane among the bin boundaries
+        int bestAxis = -1;
+        unsigned bestSplit = 0;
+        float bestCost = INFINITY;
+        for (int a = 0; a < 3; ++a) {
+            float lo = axis(centroids.bmin, a), extent = axis(centroids.bmax, a) - lo;
+            if (!(extent > 0)) continue;
+            AABB binBox[NUM_BINS];
+            unsigned binCount[NUM_BINS] = { 0 };
+            float scale = NUM_BINS / extent;
+            for (unsigned k = first; k < first + count; ++k) {
+                const Sphere<Material> &sphere = spheres[indices[k]];
+                unsigned b = bin(axis(sphere.center, a), lo, scale);
+                binCount[b]++;
+                binBox[b].grow(bounds(sphere));
+            }
+            float rightArea[NUM_BINS];
+            unsigned rightCount[NUM_BINS];
+            AABB right;
+            unsigned nright = 0;
+            for (int b = NUM_BINS - 1; b > 0; --b) {
+                right.grow(binBox[b]);
+                nright += binCount[b];
+                rightArea[b] = right.area();
+                rightCount[b] = nright;
+            }
+            AABB left;
+            unsigned nleft = 0;
+            for (unsigned b = 1; b < NUM_BINS; ++b) {
+                left.grow(binBox[b - 1]);
+                nleft += binCount[b - 1];
+                if (nleft == 0 || rightCount[b] == 0) continue;
+                float cost = left.area() * nleft + rightArea[b] * rightCount[b];
+                if (cost < bestCost) bestCost = cost, bestAxis = a, bestSplit = b;
+            }
+        }
+        // traversing a node costs about as much as intersecting a sphere
+        float parentArea = box.area();
+        if (bestAxis < 0 || (parentArea > 0 && 1 + bestCost / parentArea >= count)) {
+            if (count <= MAX_LEAF_SIZE) return;
+            if (bestAxis < 0) {
+                // all the centers are at the same place: split the range in two halves
+                split(n, first + count / 2, depth);
+                return;
+            }
+        }
+        float lo = axis(centroids.bmin, bestAxis);
+        float scale = NUM_BINS / (axis(centroids.bmax, bestAxis) - lo);
+        unsigned *mid = std::partition(&indices[first], &indices[first] + count, [&](unsigned i) {
+            return bin(axis(spheres[i].center, bestAxis), lo, scale) < bestSplit;
+        });
+        split(n, unsigned(mid - &indices[0]), depth);
+    }
+    void split(unsigned n, unsigned mid, unsigned depth)
+    {
+        unsigned first = nodes[n].first, count = nodes[n].count;
+        unsigned left = nodes.size();
+        nodes.push_back(Node());
+        nodes.push_back(Node());
+        nodes[left].first = first;
+        nodes[left].count = mid - first;
+        nodes[left + 1].first = mid;
+        nodes[left + 1].count = first + count - mid;
+        nodes[n].first = left;
+        nodes[n].count = 0;
+        build(left, depth + 1);
+        build(left + 1, depth + 1);
+    }
+    static unsigned bin(float c, float lo, float scale)
+    {
+        return std::min(unsigned(NUM_BINS - 1), unsigned(std::max(float(0), (c - lo) * scale)));
+    }
+    //[comment]
+    // Sum of the areas of the boxes of the nodes
+    //[/comment]
+    double area() const
+    {
+        double sum = 0;
+        for (unsigned n = 0; n < nodes.size(); ++n) {
+            AABB box;
+            box.bmin = nodes[n].bmin, box.bmax = nodes[n].bmax;
+            sum += box.area();
+        }
+        return sum;
+    }
+    const SphereArray<Material> &spheres;
+    IntersectKernel kernel;
+    std::vector<Node> nodes;
+    std::vector<unsigned> indices;          /// sphere order, only used while building
+    SphereSoA geometry;
+    double builtArea;                       /// area() once built, see refit()
+};
+
+//[comment]
+// Math of the shading loop. The renderer is built with one of two policies,
+// typedef'd to Math:
+//
+// - FastMath (the default) stays in single precision: a cube is two multiplies
+//   and vectors are normalized with the reciprocal square root estimate of the
+//   CPU refined by a Newton-Raphson step (relative error below 1e-6). The
+//   texture coordinates use polynomial atan2() and acos() (Abramowitz and
+//   Stegun 4.4.49 and 4.4.46, errors below 1e-6 radians, a thousandth of a
+//   texel on a 4096 texel wide texture).
+// - PreciseMath, with -DRAYTRACER_PRECISE, is the reference: the math of the
+//   tutorial, which goes through double precision pow() and sqrt() (whose
+//   result is then used in double), to check the images of FastMath against.
+//
+// normalize() normalizes a vector and normalizeLength() also returns its
+// length.
+//[/comment]
+struct PreciseMath
+{
+    static float cube(float x) { return pow(x, 3); }
+    static double sqrt(float x) { return ::sqrt(x); }
+    static void normalize(Vec3f &v) { v.normalize(); }
+    static float normalizeLength(Vec3f &v)
+    {
+        float length = v.length();
+        v.normalize();
+        return length;
+    }
+    static float atan2(float y, float x) { return atan2f(y, x); }
+    static float acos(float x) { return acosf(x); }
+};
+
+struct FastMath
+{
+    static float cube(float x) { return x * x * x; }
+    static float sqrt(float x) { return std::sqrt(x); }
+    static float rsqrt(float x)
+    {
+#if defined HAVE_X86_KERNELS && defined __SSE__
+        float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+#else
+        // first guess from the bits of x, refined twice here and once more below
+        uint32_t i;
+        float y;
+        memcpy(&i, &x, sizeof(i));
+        i = 0x5f375a86 - (i >> 1);
+        memcpy(&y, &i, sizeof(y));
+        y = y * (1.5f - 0.5f * x * y * y);
+        y = y * (1.5f - 0.5f * x * y * y);
+#endif
+        return y * (1.5f - 0.5f * x * y * y);
+    }
+    static void normalize(Vec3f &v) { normalizeLength(v); }
+    static float normalizeLength(Vec3f &v)
+    {
+        float length2 = v.length2();
+        if (!(length2 > 0)) return 0;
+        float invLength = rsqrt(length2);
+        v.x *= invLength, v.y *= invLength, v.z *= invLength;
+        return length2 * invLength;
+    }
+    static float atan2(float y, float x)
+    {
+        float ax = std::fabs(x), ay = std::fabs(y);
+        float hi = std::max(ax, ay), lo = std::min(ax, ay);
+        if (!(hi > 0)) return 0;
+        // atan of a ratio in [0, 1]
+        float a = lo / hi, a2 = a * a;
+        float r = ((((((((0.0028662257f * a2 - 0.0161657367f) * a2 + 0.0429096138f) * a2 - 0.0752896400f) * a2 +
+            0.1065626393f) * a2 - 0.1420889944f) * a2 + 0.1999355085f) * a2 - 0.3333314528f) * a2 + 1) * a;
+        if (ay > ax) r = float(M_PI / 2) - r;
+        if (x < 0) r = float(M_PI) - r;
+        return y < 0 ? -r : r;
+    }
+    static float acos(float x)
+    {
+        float a = std::fabs(x);
+        float r = (((((((-0.0012624911f * a + 0.0066700901f) * a - 0.0170881256f) * a + 0.0308918810f) * a -
+            0.0501743046f) * a + 0.0889789874f) * a - 0.2145988016f) * a + 1.5707963050f) * std::sqrt(1 - a);
+        return x < 0 ? float(M_PI) - r : r;
+    }
+};
+
+#ifdef RAYTRACER_PRECISE
+typedef PreciseMath Math;
+#else
+typedef FastMath Math;
+#endif
+
+//[comment]
+// This variable controls the maximum recursion depth
+//[/comment]
+#define MAX_RAY_DEPTH 5
+
+inline float mix(const float &a, const float &b, const float &mix)
+{
+    return b * mix + a * (1 - mix);
+}
+
+//[comment]
+// Small random number generator (xorshift) used by the Russian roulette in
+// shade(). Every pixel gets its own generator, seeded with the pixel index, so
+// the image does not depend on the order in which the pixels are traced.
+//[/comment]
+class Random
+{
+public:
+    Random(uint32_t seed) : state(seed * 2654435761u ^ 0x9e3779b9u) { next(); }
+    //[comment]
+    // Uniformly distributed number in [0, 1)
+    //[/comment]
+    float next()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (state >> 8) * (1 / 16777216.f);
+    }
+private:
+    uint32_t state;
+};
+
+//[comment]
+// Ray cone of a ray, from which the width of the ray where it hits a surface is
+// computed: its width at the origin of the ray, and how much it grows per unit
+// of distance. Only the materials which filter textures need it (see
+// FlatMaterial::TEXTURED). For the others RayCone<false> is empty and its width
+// is always 0, so flat shading neither stores nor updates the cones.
+//[/comment]
+template<bool TRACKED>
+struct RayCone
+{
+    float width, spread;
+    RayCone(float w = 0, float s = 0) : width(w), spread(s) {}
+};
+
+template<>
+struct RayCone<false>
+{
+    static constexpr float width = 0, spread = 0;
+    RayCone(float = 0, float = 0) {}
+};
+
+//[comment]
+// A reflection or refraction ray waiting to be traced. weight is the fraction
+// of the color of the ray which ends up in the pixel: the product of the
+// Fresnel, transparency and surface color factors along the path from the
+// camera to the ray.
+//[/comment]
+template<typename Material>
+struct QueuedRay : RayCone<Material::TEXTURED>
+{
+    typedef RayCone<Material::TEXTURED> Cone;
+    Vec3f orig, dir, weight;
+    int depth;
+    QueuedRay() : depth(0) {}
+    QueuedRay(const Vec3f &o, const Vec3f &d, const Vec3f &w, int n, const Cone &cone) :
+        Cone(cone), orig(o), dir(d), weight(w), depth(n) {}
+};
+
+//[comment]
+// The lights of the scene: the spheres which emit light. The list is built once
+// per frame, so shading a diffuse surface only loops over the lights instead of
+// scanning all the spheres of the scene.
+//[/comment]
+template<typename Material>
+std::vector<const Sphere<Material>*> findLights(const SphereArray<Material> &spheres)
+{
+    std::vector<const Sphere<Material>*> lights;
+    for (unsigned i = 0; i < spheres.size(); ++i)
+        if (spheres[i].emissionColor.x > 0) lights.push_back(&spheres[i]);
+    return lights;
+}
+
+//[comment]
+// The bit of sphere i in a set of spheres held in 64 bits, as recorded by
+// shade(). The first 64 spheres have a bit of their own, the other ones share
+// them, so a set may hold spheres which are not in it but never misses one.
+//[/comment]
+inline uint64_t sphereBit(unsigned i)
+{
+    return uint64_t(1) << (i < 64 ? i : (i * 2654435761u) >> 26);
+}
+
+//[comment]
+// Shade one ray of a ray tree hitting sphere at tnear (or nothing if sphere is
+// NULL): its share of the emission, diffuse lighting or background is added to
+// color, and its reflection and refraction rays are handed to
+// enqueue(orig, dir, weight, depth, cone), which decides whether they get
+// traced. This is the body of shade(), shared with the wavefront renderer
+// (see renderWavefront()) which traces the rays of a tile a bounce at a time.
+//[/comment]
+template<typename Material, typename Accelerator, typename Enqueue>
+void shadeRay(
+    const QueuedRay<Material> &ray,
+    const Sphere<Material>* sphere,
+    float tnear,
+    const std::vector<const Sphere<Material>*> &lights,
+    const Accelerator &bvh,
+    Enqueue &enqueue,
+    Vec3f &color,
+    uint64_t *touched)
+{
+    typedef typename QueuedRay<Material>::Cone Cone;
+    COUNT(++rayCounters.rays);
+    COUNT(rayCounters.depth = std::max(rayCounters.depth, unsigned(ray.depth)));
+    // if there's no intersection add the background color
+    if (!sphere) {
+        color += ray.weight * Vec3f(2);
+    }
+    else {
+        if (touched) *touched |= sphereBit(bvh.indexOf(sphere));
+        Vec3f phit = ray.orig + ray.dir * tnear; // point of intersection
+        Vec3f nhit = phit - sphere->center; // normal at the intersection point
+        Math::normalize(nhit); // normalize normal direction
+        // If the normal and the view direction are not opposite to each other
+        // reverse the normal direction. That also means we are inside the sphere so set
+        // the inside bool to true. Finally reverse the sign of IdotN which we want
+        // positive.
+        float bias = 1e-4; // add some bias to the point from which we will be tracing
+        bool inside = false;
+        if (ray.dir.dot(nhit) > 0) nhit = -nhit, inside = true;
+        // the footprint grows with the distance travelled, and is stretched on
+        // surfaces seen at grazing angles
+        float width = ray.width + ray.spread * tnear;
+        float footprint = width / std::max(0.05f, -ray.dir.dot(nhit));
+        if ((sphere->transparency > 0 || sphere->reflection > 0) && ray.depth < MAX_RAY_DEPTH) {
+            float facingratio = -ray.dir.dot(nhit);
+            // change the mix value to tweak the effect
+            float fresneleffect = mix(Math::cube(1 - facingratio), 1, 0.1);
+            // the color is a mix of reflection and refraction (if the sphere is
+            // transparent), tinted by the surface color
+            Vec3f weight = ray.weight * sphere->getColor(phit, footprint);
+            // if the sphere is also transparent compute refraction ray (transmission)
+            if (sphere->transparency) {
+                float ior = 1.1, eta = (inside) ? ior : 1 / ior; // are we inside or outside the surface?
+                float cosi = -nhit.dot(ray.dir);
+                float k = 1 - eta * eta * (1 - cosi * cosi);
+                Vec3f refrdir = ray.dir * eta + nhit * (eta *  cosi - Math::sqrt(k));
+                Math::normalize(refrdir);
+                enqueue(phit - nhit * bias, refrdir, weight * ((1 - fresneleffect) * sphere->transparency), ray.depth + 1,
+                    Cone(width, ray.spread));
+            }
+            // compute reflection direction (not need to normalize because all vectors
+            // are already normalized)
+            Vec3f refldir = ray.dir - nhit * 2 * ray.dir.dot(nhit);
+            Math::normalize(refldir);
+            // a convex mirror widens the cone
+            enqueue(phit + nhit * bias, refldir, weight * fresneleffect, ray.depth + 1,
+                Cone(width, inside ? ray.spread : ray.spread + 2 * width * sphere->curvature()));
+        }
+        else {
+            // it's a diffuse object, no need to raytrace any further
+            Vec3f surfaceColor = 0, diffuse = sphere->getColor(phit, footprint);
+            for (unsigned i = 0; i < lights.size(); ++i) {
+                Vec3f lightDirection = lights[i]->center - phit;
+                float lightDistance = Math::normalizeLength(lightDirection);
+                // a light behind the surface adds nothing, don't trace the shadow ray
+                float cosine = nhit.dot(lightDirection);
+                if (!(cosine > 0)) continue;
+                // only the spheres between the point and the light cast a shadow
+                if (bvh.occluded(phit + nhit * bias, lightDirection, lightDistance, lights[i])) continue;
+                surfaceColor += diffuse * cosine * lights[i]->emissionColor;
+                if (touched) *touched |= sphereBit(bvh.indexOf(lights[i]));
+            }
+            color += ray.weight * surfaceColor;
+        }
+        color += ray.weight * sphere->emissionColor;
+    }
+}
+
+//[comment]
+// Compute the color of a ray which hits the sphere at distance tnear from its
+// origin. This is the shading part of trace(), split out so that primary rays
+// traced as a packet can share it with the single rays.
+//
+// The color of a ray only depends linearly on the color of its reflection and
+// refraction rays, so instead of calling trace() recursively for them we keep
+// the rays still to be traced in a queue, each with its weight, and add their
+// contribution to the color as they get traced: the color of a ray is the
+// weighted sum of the emission and diffuse lighting of all the surfaces of its
+// ray tree, and of the background for the rays leaving the scene.
+//
+// A transparent and reflective sphere spawns two rays per bounce but most of
+// them end up contributing very little to the pixel. Rays whose weight drops
+// below cutoff play Russian roulette: they are only traced with a probability
+// proportional to their weight, and their weight is scaled up accordingly, so
+// on average the color is the same as if all the rays had been traced.
+//
+// spread is the angle between neighbouring primary rays, from which the ray
+// cones of textured materials start. If touched is not NULL, the sphereBit()
+// of every sphere which plays a part in the color is added to it: the spheres
+// hit by the rays of the tree and the lights lighting their diffuse surfaces.
+//[/comment]
+template<typename Material, typename Accelerator>
+Vec3f shade(
+    const Vec3f &rayorig,
+    const Vec3f &raydir,
+    const Sphere<Material>* sphere,
+    float tnear,
+    const std::vector<const Sphere<Material>*> &lights,
+    const Accelerator &bvh,
+    const float &cutoff,
+    const float &spread,
+    Random &random,
+    uint64_t *touched = NULL)
+{
+    typedef typename QueuedRay<Material>::Cone Cone;
+    Vec3f color = 0;
+    // the rays are taken from the back of the queue (depth first), so it never
+    // holds more than a couple of rays per level
+    QueuedRay<Material> queue[2 * MAX_RAY_DEPTH + 2];
+    unsigned queued = 0;
+    auto enqueue = [&](const Vec3f &orig, const Vec3f &dir, Vec3f weight, int depth, const Cone &cone) {
+        float w = std::max(weight.x, std::max(weight.y, weight.z));
+        if (!(w > 0)) return; // this ray can't add anything to the pixel
+        if (w < cutoff) {
+            if (random.next() * cutoff >= w) return;
+            weight = weight * (cutoff / w);
+        }
+        queue[queued++] = QueuedRay<Material>(orig, dir, weight, depth, cone);
+    };
+    QueuedRay<Material> ray(rayorig, raydir, Vec3f(1), 0, Cone(0, spread));
+    for (;;) {
+        shadeRay(ray, sphere, tnear, lights, bvh, enqueue, color, touched);
+        if (!queued) return color;
+        ray = queue[--queued];
+        sphere = bvh.intersect(ray.orig, ray.dir, tnear);
+    }
+}
+
+//[comment]
+// This is the main trace function. It takes a ray as argument (defined by its origin
+// and direction). We test if this ray intersects any of the geometry in the scene.
+// If the ray intersects an object, we compute the intersection point, the normal
+// at the intersection point, and shade this point using this information.
+// Shading depends on the surface property (is it transparent, reflective, diffuse).
+// The function returns a color for the ray. If the ray intersects an object that
+// is the color of the object at the intersection point, otherwise it returns
+// the background color.
+//[/comment]
+template<typename Material, typename Accelerator>
+Vec3f trace(
+    const Vec3f &rayorig,
+    const Vec3f &raydir,
+    const std::vector<const Sphere<Material>*> &lights,
+    const Accelerator &bvh,
+    const float &cutoff,
+    const float &spread,
+    Random &random,
+    uint64_t *touched = NULL)
+{
+    //if (raydir.length() != 1) std::cerr << "Error " << raydir << std::endl;
+    float tnear;
+    // find intersection of this ray with the sphere in the scene
+    const Sphere<Material>* sphere = bvh.intersect(rayorig, raydir, tnear);
+    return shade(rayorig, raydir, sphere, tnear, lights, bvh, cutoff, spread, random, touched);
+}
+
+//[comment]
+// The image (or the region of it being rendered) is split into small square
+// tiles which are handed out to a pool of worker threads. Every worker owns a
+// deque of tiles: it pops work from the front of its own deque and, once that
+// is empty, steals from the back of another worker's deque. Reflective and
+// refractive spheres make some tiles much more expensive than others, so
+// stealing keeps all the threads busy until the end.
+// Each pixel is computed independently of the others, so the image does not
+// depend on the number of threads or on the order in which tiles are traced.
+//[/comment]
+struct Tile
+{
+    unsigned x0, y0, x1, y1;                /// pixel range [x0, x1) x [y0, y1)
+};
+
+//[comment]
+// The tiles of tileSize x tileSize pixels covering region, row by row (the
+// ones on the right and bottom edges may be smaller). Local renders use tiles
+// of TILE_SIZE pixels.
+//[/comment]
+#define TILE_SIZE 16
+
+inline std::vector<Tile> splitTiles(const Tile &region, unsigned tileSize)
+{
+    std::vector<Tile> tiles;
+    for (unsigned y = region.y0; y < region.y1; y += tileSize) {
+        for (unsigned x = region.x0; x < region.x1; x += tileSize) {
+            Tile tile = { x, y, std::min(x + tileSize, region.x1), std::min(y + tileSize, region.y1) };
+            tiles.push_back(tile);
+        }
+    }
+    return tiles;
+}
+
+class TileScheduler
+{
+public:
+    TileScheduler(const Tile &region, unsigned tileSize, unsigned numWorkers) :
+        TileScheduler(splitTiles(region, tileSize), numWorkers) {}
+    TileScheduler(const std::vector<Tile> &tiles, unsigned numWorkers) :
+        queues(numWorkers)
+    {
+        // deal the tiles out in contiguous runs so each worker starts on its own
+        // part of the image
+        for (unsigned i = 0; i < tiles.size(); ++i)
+            queues[i * numWorkers / tiles.size()].tiles.push_back(tiles[i]);
+    }
+    //[comment]
+    // Get the next tile for a worker. Returns false once every deque is empty.
+    //[/comment]
+    bool next(unsigned worker, Tile &tile)
+    {
+        {
+            Queue &own = queues[worker];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.tiles.empty()) {
+                tile = own.tiles.front();
+                own.tiles.pop_front();
+                return true;
+            }
+        }
+        for (unsigned i = 1; i < queues.size(); ++i) {
+            Queue &victim = queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tiles.empty()) {
+                tile = victim.tiles.back();
+                victim.tiles.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<Tile> tiles;
+    };
+    std::vector<Queue> queues;
+};
+
+//[comment]
+// Queue of the tiles which are done, from the render threads to the output
+// stage, which encodes or sends them while the other tiles are traced. Any
+// number of threads push tiles and one thread pops them, without locks: a push
+// claims the next slot with an atomic increment, fills it and marks it ready,
+// and pop() waits for the slot after the last one it popped to be ready. The
+// queue is for the numTiles tiles of one render, each pushed once, and pop()
+// returns false once they have all been popped. The slots and the two ends of
+// the queue are on cache lines of their own, so the threads pushing tiles
+// don't slow down each other or the one popping them.
+//[/comment]
+class TileQueue
+{
+public:
+    TileQueue(size_t numTiles) : slots(numTiles), tail(0), head(0) {}
+    void push(const Tile &tile)
+    {
+        Slot &slot = slots[tail.fetch_add(1, std::memory_order_relaxed)];
+        slot.tile = tile;
+        slot.ready.store(true, std::memory_order_release);
+    }
+    bool pop(Tile &tile)
+    {
+        if (head == slots.size()) return false;
+        Slot &slot = slots[head++];
+        // tiles take a while to trace, don't keep a core busy waiting for them
+        for (unsigned spins = 0; !slot.ready.load(std::memory_order_acquire); ++spins) {
+            if (spins < 64) std::this_thread::yield();
+            else std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        tile = slot.tile;
+        return true;
+    }
+private:
+    struct alignas(64) Slot
+    {
+        std::atomic<bool> ready;
+        Tile tile;
+        Slot() : ready(false) {}
+    };
+    std::vector<Slot> slots;
+    alignas(64) std::atomic<size_t> tail;   /// next slot to push to
+    alignas(64) size_t head;                /// next slot to pop, only used by the popping thread
+};
+
+//[comment]
+// The render threads, kept from frame to frame so that the passes of a
+// progressive render and the frames of an animation don't each start and join
+// their own threads. run(job) calls job(id) on every worker, id going from 0
+// to size() - 1, and returns once they all have returned. The calling thread
+// is worker 0, so a pool of one thread runs the job serially.
+//[/comment]
+class WorkerPool
+{
+public:
+    WorkerPool(unsigned numWorkers) : job(NULL), generation(0), running(0), stopping(false)
+    {
+        for (unsigned i = 1; i < numWorkers; ++i) threads.push_back(std::thread(&WorkerPool::loop, this, i));
+    }
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (unsigned i = 0; i < threads.size(); ++i) threads[i].join();
+    }
+    unsigned size() const { return threads.size() + 1; }
+    void run(const std::function<void(unsigned)> &f)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            job = &f;
+            running = threads.size();
+            ++generation;
+        }
+        wake.notify_all();
+        f(0);
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [&]() { return running == 0; });
+        job = NULL;
+    }
+private:
+    void loop(unsigned id)
+    {
+        unsigned seen = 0;
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            wake.wait(guard, [&]() { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            const std::function<void(unsigned)> &f = *job;
+            guard.unlock();
+            f(id);
+            guard.lock();
+            if (--running == 0) done.notify_one();
+        }
+    }
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wake, done;
+    const std::function<void(unsigned)> *job;
+    unsigned generation, running;           /// number of jobs given, workers still running the last one
+    bool stopping;
+};
+
+//[comment]
+// Uniform grid over the spheres of the scene, the accelerator of the scenes in
+// which many spheres of about the same size move every frame (see useGrid()).
+// It answers the same queries as BVH, with the same results, and is much
+// faster to build: the spheres are sorted into the cells their boxes overlap
+// with a counting sort, done by all the threads of a WorkerPool, so the grid is
+// built again for every frame where a BVH would be refit to spheres which end
+// up far from where they were.
+//
+// There are about CELLS_PER_SPHERE cells per sphere. The cells along a ray are
+// visited in order with a 3D-DDA, stopping at the first cell which ends beyond
+// the closest hit so far. The spheres much bigger than the typical one (like
+// the ground of the scenes) would fill lots of cells and take the space of
+// the grid, so they are kept out of it and tested by every ray.
+//[/comment]
+template<typename Material>
+class UniformGrid
+{
+public:
+    UniformGrid(const SphereArray<Material> &s, WorkerPool &pool) : spheres(s) { build(pool); }
+    //[comment]
+    // Build the grid again, for spheres which moved.
+    //[/comment]
+    void build(WorkerPool &pool)
+    {
+        std::vector<unsigned> small;
+        float limit = LARGE_RADIUS * medianRadius(spheres);
+        large.clear();
+        box = AABB();
+        AABB inside;
+        for (unsigned i = 0; i < spheres.size(); ++i) {
+            if (spheres[i].radius > limit) large.push_back(i);
+            else small.push_back(i), inside.grow(sphereBounds(spheres[i]));
+            box.grow(sphereBounds(spheres[i]));
+        }
+        items.clear();
+        cellStart.assign(2, 0);
+        for (int a = 0; a < 3; ++a) low[a] = 0, size[a] = 1, resolution[a] = 1;
+        if (small.empty()) return;
+        // cubic cells, except along a flat axis
+        float extent[3] = { inside.bmax.x - inside.bmin.x, inside.bmax.y - inside.bmin.y, inside.bmax.z - inside.bmin.z };
+        float longest = std::max(extent[0], std::max(extent[1], extent[2])) + 1e-6f;
+        for (int a = 0; a < 3; ++a) extent[a] = std::max(extent[a], longest * 1e-3f);
+        float edge = std::cbrt(extent[0] * extent[1] * extent[2] / (float(CELLS_PER_SPHERE) * small.size()));
+        low[0] = inside.bmin.x, low[1] = inside.bmin.y, low[2] = inside.bmin.z;
+        for (int a = 0; a < 3; ++a) {
+            resolution[a] = std::max(1u, std::min(unsigned(MAX_RESOLUTION), unsigned(std::ceil(extent[a] / edge))));
+            size[a] = extent[a] / resolution[a];
+        }
+        unsigned numCells = resolution[0] * resolution[1] * resolution[2];
+        // count the spheres of every cell, turn the counts into the start of the
+        // cells in items, then copy the spheres to their cells
+        std::unique_ptr<std::atomic<unsigned>[]> cursor(new std::atomic<unsigned>[numCells]);
+        for (unsigned c = 0; c < numCells; ++c) cursor[c].store(0, std::memory_order_relaxed);
+        auto pass = [&](bool scatter) {
+            pool.run([&](unsigned id) {
+                size_t begin = small.size() * id / pool.size(), end = small.size() * (id + 1) / pool.size();
+                for (size_t k = begin; k < end; ++k) {
+                    unsigned i = small[k], from[3], to[3];
+                    cellRange(sphereBounds(spheres[i]), from, to);
+                    for (unsigned z = from[2]; z <= to[2]; ++z)
+                        for (unsigned y = from[1]; y <= to[1]; ++y)
+                            for (unsigned x = from[0]; x <= to[0]; ++x) {
+                                unsigned slot = cursor[(z * resolution[1] + y) * resolution[0] + x].fetch_add(1,
+                                    std::memory_order_relaxed);
+                                if (scatter) items[slot] = i;
+                            }
+                }
+            });
+        };
+        pass(false);
+        cellStart.resize(numCells + 1);
+        for (unsigned c = 0; c < numCells; ++c) {
+            cellStart[c + 1] = cellStart[c] + cursor[c].load(std::memory_order_relaxed);
+            cursor[c].store(cellStart[c], std::memory_order_relaxed);
+        }
+        items.resize(cellStart[numCells]);
+        pass(true);
+    }
+    unsigned indexOf(const Sphere<Material> *sphere) const { return unsigned(sphere - &spheres[0]); }
+    AABB bounds() const { return box; }
+    //[comment]
+    // Whether a grid suits spheres: most of them have about the same size, and
+    // few are big enough to be kept out of the grid.
+    //[/comment]
+    static bool suited(const SphereArray<Material> &spheres)
+    {
+        std::vector<float> radii;
+        for (unsigned i = 0; i < spheres.size(); ++i) radii.push_back(spheres[i].radius);
+        if (radii.empty()) return false;
+        std::nth_element(radii.begin(), radii.begin() + radii.size() / 2, radii.end());
+        float median = radii[radii.size() / 2];
+        unsigned bigger = 0, huge = 0;
+        for (unsigned i = 0; i < radii.size(); ++i) bigger += radii[i] > 4 * median, huge += radii[i] > LARGE_RADIUS * median;
+        return bigger <= radii.size() / 10 && huge <= MAX_LARGE;
+    }
+    //[comment]
+    // Same as BVH::intersect().
+    //[/comment]
+    const Sphere<Material>* intersect(const Vec3f &rayorig, const Vec3f &raydir, float &tnear) const
+    {
+        unsigned sphere = ~0u;
+        tnear = INFINITY;
+        auto test = [&](unsigned i) {
+            float t;
+            if (!spheres[i].intersect(rayorig, raydir, t)) return;
+            if (t < tnear || (t == tnear && i < sphere)) tnear = t, sphere = i;
+        };
+        COUNT(rayCounters.tests += large.size());
+        for (unsigned k = 0; k < large.size(); ++k) test(large[k]);
+        walk(rayorig, raydir, tnear, [&](unsigned first, unsigned last, float exit) {
+            COUNT(rayCounters.tests += last - first);
+            for (unsigned k = first; k < last; ++k) test(items[k]);
+            return tnear <= exit;
+        });
+        return sphere == ~0u ? NULL : &spheres[sphere];
+    }
+    //[comment]
+    // Same as BVH::occluded().
+    //[/comment]
+    bool occluded(const Vec3f &rayorig, const Vec3f &raydir, float tmax, const Sphere<Material>* ignore) const
+    {
+        COUNT(++rayCounters.shadowRays);
+        unsigned skip = ignore ? indexOf(ignore) : ~0u;
+        auto blocks = [&](unsigned i) {
+            float t;
+            return i != skip && spheres[i].intersect(rayorig, raydir, t) && t < tmax;
+        };
+        COUNT(rayCounters.tests += large.size());
+        for (unsigned k = 0; k < large.size(); ++k)
+            if (blocks(large[k])) return true;
+        bool hit = false;
+        walk(rayorig, raydir, tmax, [&](unsigned first, unsigned last, float exit) {
+            COUNT(rayCounters.tests += last - first);
+            for (unsigned k = first; k < last && !hit; ++k) hit = blocks(items[k]);
+            return hit || exit >= tmax;
+        });
+        return hit;
+    }
+    //[comment]
+    // Same as BVH::intersect() for a packet. The grid has nothing to share
+    // between the rays, they are traced one by one.
+    //[/comment]
+    template<unsigned SIZE>
+    void intersect(RayPacket<SIZE> &packet) const
+    {
+        for (unsigned i = 0; i < RayPacket<SIZE>::LANES; ++i) {
+            packet.tnear[i] = INFINITY;
+            packet.sphere[i] = ~0u;
+            if (!(packet.active >> i & 1)) continue;
+            const Sphere<Material>* sphere = intersect(packet.orig, Vec3f(packet.dx[i], packet.dy[i], packet.dz[i]),
+                packet.tnear[i]);
+            if (sphere) packet.sphere[i] = indexOf(sphere);
+        }
+    }
+private:
+    enum { CELLS_PER_SPHERE = 2, MAX_RESOLUTION = 512, LARGE_RADIUS = 16, MAX_LARGE = 16 };
+    static float medianRadius(const SphereArray<Material> &spheres)
+    {
+        std::vector<float> radii;
+        for (unsigned i = 0; i < spheres.size(); ++i) radii.push_back(spheres[i].radius);
+        if (radii.empty()) return 0;
+        std::nth_element(radii.begin(), radii.begin() + radii.size() / 2, radii.end());
+        return radii[radii.size() / 2];
+    }
+    unsigned cell(float v, int a) const
+    {
+        float c = (v - low[a]) / size[a];
+        return c <= 0 ? 0 : std::min(resolution[a] - 1, unsigned(c));
+    }
+    void cellRange(const AABB &b, unsigned *from, unsigned *to) const
+    {
+        from[0] = cell(b.bmin.x, 0), from[1] = cell(b.bmin.y, 1), from[2] = cell(b.bmin.z, 2);
+        to[0] = cell(b.bmax.x, 0), to[1] = cell(b.bmax.y, 1), to[2] = cell(b.bmax.z, 2);
+    }
+    //[comment]
+    // 3D-DDA: call visit(first, last, exit) with the range of items of every cell
+    // the ray crosses before tmax, in order, exit being the distance at which
+    // the ray leaves the cell, until visit returns true.
+    //[/comment]
+    template<typename Visit>
+    void walk(const Vec3f &rayorig, const Vec3f &raydir, float tmax, const Visit &visit) const
+    {
+        if (items.empty()) return;
+        const float o[3] = { rayorig.x, rayorig.y, rayorig.z }, d[3] = { raydir.x, raydir.y, raydir.z };
+        float invdir[3], next[3], delta[3], tmin = 0;
+        int step[3], at[3];
+        for (int a = 0; a < 3; ++a) {
+            // avoid (0 * inf) for axis aligned rays, like the slab test of BVH
+            invdir[a] = 1 / (std::fabs(d[a]) > 1e-20f ? d[a] : std::copysign(1e-20f, d[a]));
+            float t0 = (low[a] - o[a]) * invdir[a], t1 = (low[a] + resolution[a] * size[a] - o[a]) * invdir[a];
+            tmin = std::max(tmin, std::min(t0, t1));
+            tmax = std::min(tmax, std::max(t0, t1));
+        }
+        if (!(tmin <= tmax)) return;
+        for (int a = 0; a < 3; ++a) {
+            at[a] = cell(o[a] + d[a] * tmin, a);
+            step[a] = invdir[a] < 0 ? -1 : 1;
+            next[a] = (low[a] + (at[a] + (step[a] > 0)) * size[a] - o[a]) * invdir[a];
+            delta[a] = size[a] * std::fabs(invdir[a]);
+        }
+        for (;;) {
+            unsigned c = (at[2] * resolution[1] + at[1]) * resolution[0] + at[0];
+            int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+            if (visit(cellStart[c], cellStart[c + 1], next[a]) || next[a] > tmax) return;
+            at[a] += step[a];
+            if (at[a] < 0 || at[a] >= int(resolution[a])) return;
+            next[a] += delta[a];
+        }
+    }
+    const SphereArray<Material> &spheres;
+    std::vector<unsigned> large;            /// spheres kept out of the grid, tested by every ray
+    std::vector<unsigned> cellStart;        /// the spheres of cell c are items[cellStart[c]] to items[cellStart[c + 1] - 1]
+    std::vector<unsigned> items;
+    float low[3], size[3];                  /// corner of the grid and size of the cells
+    unsigned resolution[3];                 /// number of cells along each axis
+    AABB box;                               /// bounds of all the spheres
+};
+
+//[comment]
+// Output stage. The float image is clamped and quantized to 8-bit RGB in one
+// pass and written to the file with a single write. The quantization is the
+// one of the original tutorial, (unsigned char)(min(1, x) * 255), plus a clamp
+// to 0 for negative values.
+//[/comment]
+enum ImageFormat { PPM, PNG };
+
+inline void quantize(const Vec3f *image, size_t numPixels, unsigned char *rgb)
+{
+    static_assert(sizeof(Vec3f) == 3 * sizeof(float), "Vec3f must be three packed floats");
+    // the image is just an array of floats as far as quantization is concerned
+    const float *src = &image[0].x;
+    size_t n = 3 * numPixels, i = 0;
+#if defined HAVE_X86_KERNELS && defined __SSE2__
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1), scale = _mm_set1_ps(255);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v[4];
+        for (int k = 0; k < 4; ++k) {
+            // min(x, 1) returns 1 for NaN like std::min(1, x) does
+            __m128 x = _mm_max_ps(_mm_min_ps(_mm_loadu_ps(src + i + 4 * k), one), zero);
+            v[k] = _mm_cvttps_epi32(_mm_mul_ps(x, scale));
+        }
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(rgb + i), packed);
+    }
+#endif
+    for (; i < n; ++i) rgb[i] = (unsigned char)(std::max(float(0), std::min(float(1), src[i])) * 255);
+}
+
+//[comment]
+// CRC and Adler checksums needed to write PNG files
+//[/comment]
+inline uint32_t crc32(const unsigned char *data, size_t size, uint32_t crc = 0)
+{
+    static uint32_t table[256];
+    static bool init = [] {
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+        return true;
+    }();
+    (void)init;
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+inline uint32_t adler32(const unsigned char *data, size_t size, uint32_t adler = 1)
+{
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (size) {
+        // delay the modulo as long as the sums can't overflow
+        size_t n = std::min(size, size_t(5552));
+        for (size_t i = 0; i < n; ++i) a += data[i], b += a;
+        a %= 65521, b %= 65521;
+        data += n, size -= n;
+    }
+    return b << 16 | a;
+}
+
+//[comment]
+// Encoder of an 8-bit RGB image, which takes the rows top to bottom, a few at a
+// time, and appends the file to out as they come: the output stage can encode
+// the top of an image while the bottom is traced (see writeTiles()). PNG files
+// are written without compression (the image data is stored in uncompressed
+// deflate blocks), which keeps the writer small and free of dependencies while
+// giving files any viewer can open. The size of the data is known up front,
+// so the chunk holding it is written in one go, its checksums computed on the
+// way.
+//[/comment]
+class ImageEncoder
+{
+public:
+    ImageEncoder(ImageFormat format, unsigned width, unsigned height, std::vector<unsigned char> &output) :
+        format(format), rowBytes(size_t(width) * 3), rawSize((rowBytes + 1) * height), rawPos(0), adler(1), crc(0),
+        out(output)
+    {
+        if (format == PPM) {
+            char header[64];
+            int n = snprintf(header, sizeof(header), "P6\n%u %u\n255\n", width, height);
+            out.insert(out.end(), header, header + n);
+            return;
+        }
+        static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        out.insert(out.end(), signature, signature + 8);
+        unsigned char ihdr[13] = { 0 };
+        for (int k = 0; k < 4; ++k) ihdr[k] = width >> (24 - 8 * k), ihdr[4 + k] = height >> (24 - 8 * k);
+        ihdr[8] = 8; // bit depth
+        ihdr[9] = 2; // color type: RGB
+        chunk("IHDR", ihdr, sizeof(ihdr));
+        // the zlib stream: its header, the raw data in blocks of at most 65535
+        // bytes with 5 bytes of header each (at least one block), and its checksum
+        size_t blocks = std::max(size_t(1), (rawSize + 65534) / 65535);
+        put32(2 + rawSize + 5 * blocks + 4);
+        static const unsigned char start[6] = { 'I', 'D', 'A', 'T', 0x78, 0x01 };
+        data(start, sizeof(start));
+    }
+    //[comment]
+    // Encode the next rows of the image
+    //[/comment]
+    void addRows(const unsigned char *rgb, unsigned rows)
+    {
+        if (format == PPM) {
+            out.insert(out.end(), rgb, rgb + rows * rowBytes);
+            return;
+        }
+        // each row is prefixed with its filter type (0, no filter)
+        static const unsigned char filter = 0;
+        for (unsigned y = 0; y < rows; ++y) {
+            raw(&filter, 1);
+            raw(rgb + y * rowBytes, rowBytes);
+        }
+    }
+    //[comment]
+    // End the file, once all the rows have been added
+    //[/comment]
+    void finish()
+    {
+        if (format == PPM) return;
+        if (rawSize == 0) {
+            static const unsigned char empty[5] = { 1, 0, 0, 0xff, 0xff };
+            data(empty, sizeof(empty));
+        }
+        unsigned char checksum[4];
+        for (int k = 0; k < 4; ++k) checksum[k] = adler >> (24 - 8 * k);
+        data(checksum, sizeof(checksum));
+        put32(crc);
+        chunk("IEND", NULL, 0);
+    }
+private:
+    ImageFormat format;
+    size_t rowBytes, rawSize, rawPos;       /// bytes per row, of image data (rows and filter types), written so far
+    uint32_t adler, crc;                    /// checksums of the image data and of the data chunk so far
+    std::vector<unsigned char> &out;
+    void put32(uint32_t v)
+    {
+        unsigned char b[4] = { (unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char)v };
+        out.insert(out.end(), b, b + 4);
+    }
+    // bytes of the data chunk, which its CRC covers along with its type
+    void data(const unsigned char *p, size_t n)
+    {
+        out.insert(out.end(), p, p + n);
+        crc = crc32(p, n, crc);
+    }
+    // image data, split into deflate blocks
+    void raw(const unsigned char *p, size_t n)
+    {
+        while (n) {
+            size_t offset = rawPos % 65535;
+            if (offset == 0) {
+                size_t size = std::min(rawSize - rawPos, size_t(65535));
+                bool last = rawPos + size == rawSize;
+                unsigned char block[5] = { (unsigned char)last, (unsigned char)size, (unsigned char)(size >> 8),
+                    (unsigned char)~size, (unsigned char)(~size >> 8) };
+                data(block, sizeof(block));
+            }
+            size_t k = std::min(n, 65535 - offset);
+            data(p, k);
+            adler = adler32(p, k, adler);
+            rawPos += k, p += k, n -= k;
+        }
+    }
+    void chunk(const char *type, const unsigned char *p, size_t n)
+    {
+        put32(n);
+        size_t start = out.size();
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), p, p + n);
+        put32(crc32(&out[start], out.size() - start));
+    }
+};
+
+//[comment]
+// Encode a whole 8-bit RGB image
+//[/comment]
+inline void encodeImage(ImageFormat format, const unsigned char *rgb, unsigned width, unsigned height, std::vector<unsigned char> &out)
+{
+    out.clear();
+    ImageEncoder encoder(format, width, height, out);
+    encoder.addRows(rgb, height);
+    encoder.finish();
+}
+
+//[comment]
+// Save the image, already quantized to 8-bit RGB, to a file. Returns false if
+// the file can't be written.
+//[/comment]
+inline bool writeImage(const std::string &filename, ImageFormat format, const unsigned char *rgb, unsigned width, unsigned height)
+{
+    std::vector<unsigned char> encoded;
+    encodeImage(format, rgb, width, height, encoded);
+    // keep these flags if you compile under Windows
+    std::ofstream ofs(filename.c_str(), std::ios::out | std::ios::binary);
+    ofs.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+    return bool(ofs);
+}
+
+//[comment]
+// Save the image to a file. Returns false if the file can't be written.
+//[/comment]
+inline bool writeImage(const std::string &filename, ImageFormat format, const Vec3f *image, unsigned width, unsigned height)
+{
+    std::vector<unsigned char> rgb(size_t(width) * height * 3);
+    quantize(image, size_t(width) * height, rgb.data());
+    return writeImage(filename, format, rgb.data(), width, height);
+}
+
+//[comment]
+// Image format of a file name: PNG for .png files, PPM otherwise
+//[/comment]
+inline ImageFormat formatFromFilename(const std::string &filename)
+{
+    size_t n = filename.size();
+    return n >= 4 && (filename.compare(n - 4, 4, ".png") == 0 || filename.compare(n - 4, 4, ".PNG") == 0) ? PNG : PPM;
+}
+
+//[comment]
+// The contents of a file, mapped in memory when the platform supports it
+// (HAVE_MMAP) or read into a buffer otherwise. data is NULL if the file can't
+// be read.
+//[/comment]
+class MappedFile
+{
+public:
+    const unsigned char *data;
+    size_t size;
+
+    MappedFile(const std::string &filename) : data(NULL), size(0), mapped(false)
+    {
+#ifdef HAVE_MMAP
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                data = static_cast<const unsigned char*>(p);
+                size = st.st_size;
+                mapped = true;
+            }
+        }
+        close(fd);
+        if (mapped) return;
+#endif
+        std::ifstream file(filename, std::ios::binary);
+        if (!file) return;
+        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+    }
+
+    ~MappedFile()
+    {
+#ifdef HAVE_MMAP
+        if (mapped) munmap(const_cast<unsigned char*>(data), size);
+#endif
+    }
+
+private:
+    bool mapped;
+    std::vector<unsigned char> buffer;
+    MappedFile(const MappedFile &);
+    MappedFile& operator = (const MappedFile &);
+};
+
+//[comment]
+// Read a binary PPM file with 8-bit samples (P6, as written by writeImage())
+// into rgb. Returns false if the file can't be read or isn't such a file.
+//[/comment]
+inline bool readImage(const std::string &filename, std::vector<unsigned char> &rgb, unsigned &width, unsigned &height)
+{
+    MappedFile file(filename);
+    if (!file.data || file.size < 2 || file.data[0] != 'P' || file.data[1] != '6') return false;
+    const unsigned char *p = file.data + 2, *end = file.data + file.size;
+    unsigned values[3];                     // width, height and maximum sample value
+    for (int i = 0; i < 3; ++i) {
+        // whitespace and comments in front of every value of the header
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' || *p == '#')) {
+            if (*p == '#') while (p < end && *p != '\n') ++p;
+            else ++p;
+        }
+        if (p == end || *p < '0' || *p > '9') return false;
+        for (values[i] = 0; p < end && *p >= '0' && *p <= '9' && values[i] < 65536; ++p) values[i] = values[i] * 10 + (*p - '0');
+    }
+    // a single whitespace character ends the header
+    if (values[2] != 255 || p == end || !(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) return false;
+    ++p;
+    size_t size = size_t(values[0]) * values[1] * 3;
+    if (size_t(end - p) < size) return false;
+    width = values[0], height = values[1];
+    rgb.assign(p, p + size);
+    return true;
+}
+
+//[comment]
+// The camera: where it stands (eye), the point it looks at, which way is up,
+// its vertical field of view in degrees and the resolution of the image. The
+// default camera is the one of the tutorial, at the origin looking down -Z.
+// With a crop region only the pixels [x0, x1) x [y0, y1) of the image are
+// rendered, each one exactly as in the whole image, to re-render the part of
+// an image which changed: the output image is then the size of the region.
+//[/comment]
+struct Camera
+{
+    Vec3f eye, lookAt, up;
+    float fov;                              /// vertical field of view, in degrees
+    unsigned width, height;                 /// resolution of the whole image
+    Tile crop;                              /// region rendered, empty for the whole image
+    Camera() : eye(0), lookAt(0, 0, -1), up(0, 1, 0), fov(30), width(640), height(480), crop() {}
+    Tile region() const
+    {
+        if (crop.x0 < crop.x1 && crop.y0 < crop.y1) return crop;
+        Tile all = { 0, 0, width, height };
+        return all;
+    }
+    unsigned imageWidth() const { return region().x1 - region().x0; }
+    unsigned imageHeight() const { return region().y1 - region().y0; }
+    //[comment]
+    // Read one setting from in: "eye X Y Z", "lookat X Y Z", "up X Y Z", "fov
+    // DEGREES", "resolution WIDTH HEIGHT" or "crop X0 Y0 X1 Y1", keyword being
+    // already read. Returns false if the keyword is unknown or the values are
+    // missing. Scene files and the command line options both go through it.
+    //[/comment]
+    bool parse(const std::string &keyword, std::istream &in)
+    {
+        if (keyword == "eye") return bool(in >> eye.x >> eye.y >> eye.z);
+        if (keyword == "lookat") return bool(in >> lookAt.x >> lookAt.y >> lookAt.z);
+        if (keyword == "up") return bool(in >> up.x >> up.y >> up.z);
+        if (keyword == "fov") return bool(in >> fov);
+        if (keyword == "resolution") return bool(in >> width >> height);
+        if (keyword == "crop") return bool(in >> crop.x0 >> crop.y0 >> crop.x1 >> crop.y1);
+        return false;
+    }
+    //[comment]
+    // Check the settings once they are all read. Returns what is wrong, or NULL
+    // if the camera is valid.
+    //[/comment]
+    const char* check() const
+    {
+        const unsigned MAX_SIZE = 1 << 15;
+        Vec3f forward = lookAt - eye;
+        if (!(forward.length2() > 0)) return "the camera must not be at the point it looks at";
+        if (!(forward.cross(up).length2() > 1e-12 * forward.length2() * up.length2()))
+            return "the up direction must not be along the view direction";
+        if (!(fov > 0 && fov < 180)) return "the field of view must be between 0 and 180 degrees";
+        if (width == 0 || height == 0 || width > MAX_SIZE || height > MAX_SIZE)
+            return "the resolution must be between 1x1 and 32768x32768";
+        if ((crop.x0 || crop.y0 || crop.x1 || crop.y1) &&
+            !(crop.x0 < crop.x1 && crop.y0 < crop.y1 && crop.x1 <= width && crop.y1 <= height))
+            return "the crop region must be a non-empty part of the image";
+        return NULL;
+    }
+};
+
+//[comment]
+// The primary rays of a camera for a frame. Everything which only depends on
+// the column or the row of a pixel is computed once per frame, so the ray
+// through the center of pixel (x, y) costs two table lookups and a normalize.
+// Pixels are stored in the image of the region being rendered, but their
+// random numbers are seeded from their position in the whole image, so a
+// cropped render matches the same pixels of the whole one.
+//[/comment]
+class PrimaryRays
+{
+public:
+    Vec3f origin;
+    float spread;                           /// angle between neighbouring rays, where the ray cones start
+    Tile region;                            /// pixels rendered
+    PrimaryRays(const Camera &camera) :
+        origin(camera.eye), region(camera.region()), width(camera.width), xs(camera.width), ys(camera.height)
+    {
+        invWidth = 1 / float(camera.width), invHeight = 1 / float(camera.height);
+        aspectratio = camera.width / float(camera.height);
+        angle = tan(M_PI * 0.5 * camera.fov / 180.);
+        spread = 2 * angle * invHeight;
+        forward = camera.lookAt - camera.eye;
+        forward.normalize();
+        right = forward.cross(camera.up);
+        right.normalize();
+        up = right.cross(forward);
+        for (unsigned x = 0; x < camera.width; ++x) xs[x] = (2 * ((x + 0.5) * invWidth) - 1) * angle * aspectratio;
+        for (unsigned y = 0; y < camera.height; ++y) ys[y] = (1 - 2 * ((y + 0.5) * invHeight)) * angle;
+    }
+    //[comment]
+    // Direction of the ray going through the center of pixel (x, y)
+    //[/comment]
+    Vec3f operator () (unsigned x, unsigned y) const { return direction(xs[x], ys[y]); }
+    //[comment]
+    // Direction of the ray going through the point (x + dx, y + dy) of the image,
+    // dx and dy being in [0, 1)
+    //[/comment]
+    Vec3f operator () (unsigned x, unsigned y, float dx, float dy) const
+    {
+        float xx = (2 * ((x + dx) * invWidth) - 1) * angle * aspectratio;
+        float yy = (1 - 2 * ((y + dy) * invHeight)) * angle;
+        return direction(xx, yy);
+    }
+    size_t pixel(unsigned x, unsigned y) const { return size_t(y - region.y0) * (region.x1 - region.x0) + x - region.x0; }
+    uint32_t seed(unsigned x, unsigned y) const { return y * width + x; }
+    //[comment]
+    // The camera basis and the tables of the columns and rows, for renderers
+    // computing the directions themselves (see renderOffload()): the ray of
+    // pixel (x, y) goes along right * columns()[x] + up * rows()[y] + forward.
+    //[/comment]
+    void basis(Vec3f &r, Vec3f &u, Vec3f &f) const { r = right, u = up, f = forward; }
+    const std::vector<float>& columns() const { return xs; }
+    const std::vector<float>& rows() const { return ys; }
+private:
+    Vec3f direction(float xx, float yy) const
+    {
+        Vec3f raydir = right * xx + up * yy + forward;
+        Math::normalize(raydir);
+        return raydir;
+    }
+    unsigned width;
+    float invWidth, invHeight, aspectratio, angle;
+    Vec3f forward, right, up;               /// camera basis
+    std::vector<float> xs, ys;              /// camera space coordinates of the columns and rows
+};
+
+//[comment]
+// How a sphere moves in an animation: at frame f, its center is where it is at
+// rest turned by f * spin degrees around the vertical axis through pivot
+// (counterclockwise seen from above), then moved by f * velocity. Giving some
+// spheres the same pivot and spin puts them on a turntable.
+//[/comment]
+struct SphereMotion
+{
+    Vec3f velocity, pivot;
+    float spin;                             /// degrees per frame
+    SphereMotion() : spin(0) {}
+    Vec3f position(const Vec3f &rest, unsigned frame) const
+    {
+        Vec3f p = rest;
+        if (spin != 0) {
+            double angle = double(spin) * frame * M_PI / 180;
+            float c = cos(angle), s = sin(angle);
+            Vec3f d = rest - pivot;
+            p = pivot + Vec3f(d.x * c + d.z * s, d.y, d.z * c - d.x * s);
+        }
+        return p + velocity * float(frame);
+    }
+};
+
+//[comment]
+// A scene: the spheres, the camera, how the spheres move in an animation, and
+// the BVH built over them when the scene was loaded from a binary scene file
+// holding one (otherwise the BVH is built when the scene is rendered).
+//[/comment]
+template<typename Material>
+struct Scene
+{
+    static_assert(std::is_trivially_copyable<Sphere<Material> >::value, "spheres must be plain records");
+    std::unique_ptr<Arena> arena;           /// memory of the spheres, freed with the scene
+    SphereArray<Material> spheres;
+    std::vector<BVHNode> nodes;             /// prebuilt BVH, empty if there is none
+    std::vector<unsigned> slots;            /// sphere index of each SoA slot of the prebuilt BVH
+    Camera camera;
+    std::vector<SphereMotion> motions;      /// motion of each sphere, empty if none of them moves
+    Scene() : arena(new Arena), spheres(ArenaAllocator<Sphere<Material> >(arena.get())) {}
+    Scene(Scene &&) = default;
+    Scene& operator = (Scene &&other)
+    {
+        // the spheres go first, their memory is in the arena being replaced
+        spheres = std::move(other.spheres);
+        nodes = std::move(other.nodes);
+        slots = std::move(other.slots);
+        camera = other.camera;
+        motions = std::move(other.motions);
+        arena = std::move(other.arena);
+        return *this;
+    }
+};
+
+//[comment]
+// Text scene files describe one sphere per line:
+//
+//     sphere x y z radius r g b reflection transparency [emission r g b]
+//
+// with the parameters of the Sphere constructor: position, radius, surface
+// color, reflectivity, transparency and emission color (black if not given).
+// A "texture FILE" option gives the sphere the material library.get(FILE)
+// (materials without textures ignore it). In animations, a sphere with a
+// "velocity X Y Z" option moves by that much per frame and one with "orbit X
+// Y Z DEGREES" turns around the vertical axis through (X, Y, Z) by DEGREES
+// per frame (see SphereMotion). A line
+//
+//     camera [eye X Y Z] [lookat X Y Z] [up X Y Z] [fov DEGREES]
+//            [resolution WIDTH HEIGHT] [crop X0 Y0 X1 Y1]
+//
+// sets the camera (see Camera, on a single line). A # starts a comment which
+// runs to the end of the line. Returns false, after printing where the error is, if
+// the file can't be read or has an error.
+//[/comment]
+template<typename Material>
+bool loadTextScene(const std::string &filename, typename Material::Library &library, Scene<Material> &scene)
+{
+    std::ifstream file(filename.c_str());
+    if (!file) {
+        std::cerr << "Can't open scene file " << filename << std::endl;
+        return false;
+    }
+    scene = Scene<Material>();
+    bool textured = false;
+    std::string line;
+    for (unsigned lineNumber = 1; std::getline(file, line); ++lineNumber) {
+        std::istringstream in(line.substr(0, line.find('#')));
+        std::string keyword;
+        if (!(in >> keyword)) continue;
+        if (keyword == "camera") {
+            std::string setting;
+            while (in >> setting) {
+                if (!scene.camera.parse(setting, in)) {
+                    std::cerr << filename << ":" << lineNumber << ": invalid camera setting " << setting << std::endl;
+                    return false;
+                }
+            }
+            continue;
+        }
+        if (keyword != "sphere") {
+            std::cerr << filename << ":" << lineNumber << ": unknown keyword " << keyword << std::endl;
+            return false;
+        }
+        Vec3f center, color, emission;
+        float radius, reflection, transparency;
+        Material material;
+        bool ok = bool(in >> center.x >> center.y >> center.z >> radius >> color.x >> color.y >> color.z >>
+            reflection >> transparency) && radius >= 0;
+        std::string option, texture;
+        SphereMotion motion;
+        while (ok && in >> option) {
+            if (option == "emission") ok = bool(in >> emission.x >> emission.y >> emission.z);
+            else if (option == "texture") ok = bool(in >> texture);
+            else if (option == "velocity") ok = bool(in >> motion.velocity.x >> motion.velocity.y >> motion.velocity.z);
+            else if (option == "orbit") ok = bool(in >> motion.pivot.x >> motion.pivot.y >> motion.pivot.z >> motion.spin);
+            else ok = false;
+        }
+        if (!ok) {
+            std::cerr << filename << ":" << lineNumber << ": invalid sphere" << std::endl;
+            return false;
+        }
+        if (!texture.empty()) material = library.get(texture), textured = true;
+        scene.spheres.push_back(Sphere<Material>(center, radius, color, reflection, transparency, emission, material));
+        bool moving = motion.velocity.length2() > 0 || motion.spin != 0;
+        if (moving && scene.motions.empty()) scene.motions.resize(scene.spheres.size() - 1);
+        if (!scene.motions.empty()) scene.motions.push_back(motion);
+    }
+    if (textured && !Material::TEXTURED) std::cerr << "Ignoring the textures of " << filename << std::endl;
+    if (const char *error = scene.camera.check()) {
+        std::cerr << filename << ": invalid camera: " << error << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//[comment]
+// Binary scene files hold the spheres in a flat layout meant to be mapped in
+// memory, along with the BVH built over them so that large scenes start in
+// milliseconds instead of being parsed and having their BVH built on every run.
+// A file starts with a SceneFileHeader followed by the sections it points to,
+// each one aligned to 64 bytes: the spheres (a SphereRecord each), the BVH
+// nodes, the sphere index of every SoA slot (the BVH is optional, numNodes and
+// numSlots are 0 without it) and the texture file names of the materials
+// (each one a uint32_t length followed by the characters). They have no
+// camera and no motions, scenes loaded from them get the default camera and
+// stand still.
+// All the values are little endian. The version is bumped whenever the layout
+// changes, and files with another version are rejected.
+//[/comment]
+const char SCENE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+const uint32_t SCENE_VERSION = 1;
+
+struct SceneFileHeader
+{
+    char magic[8];                          /// SCENE_MAGIC
+    uint32_t version;                       /// SCENE_VERSION
+    uint32_t numSpheres;
+    uint32_t numNodes;
+    uint32_t numSlots;
+    uint32_t numTextures;
+    uint32_t reserved;
+    uint64_t spheresOffset;                 /// offsets of the sections from the start of the file
+    uint64_t nodesOffset;
+    uint64_t slotsOffset;
+    uint64_t texturesOffset;
+};
+
+struct SphereRecord
+{
+    float center[3], radius;
+    float surfaceColor[3], reflection;
+    float emissionColor[3], transparency;
+    int32_t texture;                        /// index of the texture file name, -1 if none
+    uint32_t reserved[3];
+};
+
+static_assert(sizeof(SceneFileHeader) == 64 && sizeof(SphereRecord) == 64, "unexpected scene file layout");
+static_assert(sizeof(BVHNode) == 32, "unexpected BVH node layout");
+
+//[comment]
+// Load a binary scene file. The spheres (and the BVH if there is one) are read
+// straight from the mapped file. Returns false if the file can't be read or is
+// not a valid scene file.
+//[/comment]
+template<typename Material>
+bool loadBinaryScene(const std::string &filename, typename Material::Library &library, Scene<Material> &scene)
+{
+    MappedFile file(filename);
+    if (!file.data) {
+        std::cerr << "Can't open scene file " << filename << std::endl;
+        return false;
+    }
+    auto invalid = [&](const char *reason) {
+        std::cerr << "Invalid scene file " << filename << ": " << reason << std::endl;
+        return false;
+    };
+    SceneFileHeader header;
+    if (file.size < sizeof(header)) return invalid("truncated header");
+    memcpy(&header, file.data, sizeof(header));
+    if (memcmp(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC))) return invalid("not a scene file");
+    if (header.version != SCENE_VERSION) return invalid("unsupported version");
+    // every section must fit in the file
+    auto fits = [&](uint64_t offset, uint64_t count, size_t size) {
+        return offset <= file.size && count <= (file.size - offset) / size;
+    };
+    if (!fits(header.spheresOffset, header.numSpheres, sizeof(SphereRecord)) ||
+        !fits(header.nodesOffset, header.numNodes, sizeof(BVHNode)) ||
+        !fits(header.slotsOffset, header.numSlots, sizeof(uint32_t)) ||
+        !fits(header.texturesOffset, header.numTextures, sizeof(uint32_t)))
+        return invalid("truncated file");
+    std::vector<Material> materials;
+    uint64_t offset = header.texturesOffset;
+    for (uint32_t i = 0; i < header.numTextures; ++i) {
+        uint32_t length;
+        if (!fits(offset, 1, sizeof(length))) return invalid("truncated file");
+        memcpy(&length, file.data + offset, sizeof(length));
+        offset += sizeof(length);
+        if (!fits(offset, length, 1)) return invalid("truncated file");
+        materials.push_back(library.get(std::string(reinterpret_cast<const char*>(file.data + offset), length)));
+        offset += length;
+    }
+    scene = Scene<Material>();
+    scene.spheres.reserve(header.numSpheres);
+    bool textured = false;
+    for (uint32_t i = 0; i < header.numSpheres; ++i) {
+        SphereRecord r;
+        memcpy(&r, file.data + header.spheresOffset + i * sizeof(r), sizeof(r));
+        if (r.texture >= int32_t(header.numTextures)) {
+            scene = Scene<Material>();
+            return invalid("invalid texture");
+        }
+        // the center, radius, colors, reflection and transparency are the 12 floats at the start of the record
+        float values[12];
+        memcpy(values, &r, sizeof(values));
+        bool finite = true;
+        for (unsigned k = 0; k < 12; ++k) finite = finite && std::isfinite(values[k]);
+        if (!finite || r.radius < 0) {
+            scene = Scene<Material>();
+            return invalid("invalid sphere");
+        }
+        scene.spheres.push_back(Sphere<Material>(Vec3f(r.center[0], r.center[1], r.center[2]), r.radius,
+            Vec3f(r.surfaceColor[0], r.surfaceColor[1], r.surfaceColor[2]), r.reflection, r.transparency,
+            Vec3f(r.emissionColor[0], r.emissionColor[1], r.emissionColor[2]),
+            r.texture >= 0 ? materials[r.texture] : Material()));
+        textured |= r.texture >= 0;
+    }
+    if (textured && !Material::TEXTURED) std::cerr << "Ignoring the textures of " << filename << std::endl;
+    if (header.numNodes) {
+        scene.nodes.resize(header.numNodes);
+        scene.slots.resize(header.numSlots);
+        memcpy(scene.nodes.data(), file.data + header.nodesOffset, header.numNodes * sizeof(BVHNode));
+        memcpy(scene.slots.data(), file.data + header.slotsOffset, header.numSlots * sizeof(uint32_t));
+        if (!BVH<Material>::valid(scene.nodes, scene.slots, header.numSpheres)) {
+            scene = Scene<Material>();
+            return invalid("corrupted BVH");
+        }
+    }
+    return true;
+}
+
+//[comment]
+// Save spheres to a binary scene file, with the BVH built over them if bvh is
+// not NULL. Returns false if the file can't be written.
+//[/comment]
+template<typename Material>
+bool saveBinaryScene(const std::string &filename, const SphereArray<Material> &spheres, const BVH<Material> *bvh)
+{
+    std::vector<char> data(sizeof(SceneFileHeader));
+    auto align = [&]() { data.resize((data.size() + 63) / 64 * 64); return data.size(); };
+    auto append = [&](const void *p, size_t size) {
+        data.insert(data.end(), static_cast<const char*>(p), static_cast<const char*>(p) + size);
+    };
+    SceneFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+    header.version = SCENE_VERSION;
+    header.numSpheres = spheres.size();
+    header.spheresOffset = align();
+    // every texture file is saved once
+    std::map<std::string, int32_t> textureIndex;
+    std::vector<std::string> textures;
+    for (unsigned i = 0; i < spheres.size(); ++i) {
+        const Sphere<Material> &s = spheres[i];
+        std::string file = s.textureFile();
+        int32_t texture = -1;
+        if (!file.empty()) {
+            auto it = textureIndex.insert(std::make_pair(file, int32_t(textures.size()))).first;
+            if (it->second == int32_t(textures.size())) textures.push_back(file);
+            texture = it->second;
+        }
+        SphereRecord r = { { s.center.x, s.center.y, s.center.z }, s.radius,
+            { s.surfaceColor.x, s.surfaceColor.y, s.surfaceColor.z }, s.reflection,
+            { s.emissionColor.x, s.emissionColor.y, s.emissionColor.z }, s.transparency, texture, { 0, 0, 0 } };
+        append(&r, sizeof(r));
+    }
+    if (bvh && !spheres.empty()) {
+        header.numNodes = bvh->treeNodes().size();
+        header.nodesOffset = align();
+        append(bvh->treeNodes().data(), header.numNodes * sizeof(BVHNode));
+        header.numSlots = bvh->slots().size();
+        header.slotsOffset = align();
+        append(bvh->slots().data(), header.numSlots * sizeof(uint32_t));
+    }
+    header.numTextures = textures.size();
+    header.texturesOffset = align();
+    for (unsigned i = 0; i < textures.size(); ++i) {
+        uint32_t length = textures[i].size();
+        append(&length, sizeof(length));
+        append(textures[i].data(), length);
+    }
+    memcpy(data.data(), &header, sizeof(header));
+    std::ofstream ofs(filename.c_str(), std::ios::out | std::ios::binary);
+    ofs.write(data.data(), data.size());
+    return bool(ofs);
+}
+
+enum AcceleratorType { ACCELERATOR_AUTO, ACCELERATOR_BVH, ACCELERATOR_GRID };
+
+struct RenderOptions
+{
+    unsigned numThreads;                    /// number of render threads
+    IntersectKernel kernel;                 /// ray-sphere intersection kernel used by the BVH
+    unsigned packetSize;                    /// primary rays are traced in packets of N x N (1, 4 or 8)
+    bool wavefront;                         /// the rays of a tile are traced a bounce at a time (see renderWavefront())
+    AcceleratorType accelerator;            /// BVH or UniformGrid (see useGrid())
+    bool offload;                           /// render single images on the GPU if possible (see renderOffload())
+    float cutoff;                           /// rays with a lower weight play Russian roulette
+    std::string output;                     /// file the image is saved to
+    ImageFormat format;                     /// format of the output file
+    bool heatmap;                           /// also save heatmaps of the cost of the pixels
+    unsigned passes;                        /// progressive rendering: maximum number of passes (0 to render once)
+    float threshold;                        /// progressive rendering: standard error at which a pixel is converged
+    float timeBudget;                       /// progressive rendering: no new pass after this many seconds (0: no limit)
+    bool denoise;                           /// progressive rendering: denoise the last pass (see Denoiser)
+    std::string camera;                     /// camera settings (see Camera::parse()) overriding the ones of the scene
+    RenderOptions() : numThreads(1), kernel(intersectScalar), packetSize(4), wavefront(false),
+        accelerator(ACCELERATOR_AUTO), offload(false), cutoff(0.001),
+        output("./untitled.ppm"), format(PPM), heatmap(false), passes(0), threshold(0.01), timeBudget(0),
+        denoise(false) {}
+};
+
+typedef std::chrono::steady_clock Clock;
+
+inline double seconds(const Clock::time_point &start, const Clock::time_point &end)
+{
+    return std::chrono::duration<double>(end - start).count();
+}
+
+//[comment]
+// Time spent in the phases of a frame, in seconds: building the BVH (setup),
+// rendering the tiles (render), finding the first hit of the primary rays
+// (trace), shading the hits with their reflection, refraction and shadow rays
+// (shade) and converting the image for the output file (output). trace and
+// shade are summed over the render threads.
+//[/comment]
+struct RenderTimes
+{
+    double setup, render, trace, shade, output;
+    RenderTimes() : setup(0), render(0), trace(0), shade(0), output(0) {}
+};
+
+//[comment]
+// Cost of a pixel, shown by the heatmaps: the intersection tests and shadow rays
+// traced for the pixel, the depth of its deepest ray and the time it took. The
+// cost of tracing a packet of primary rays is shared evenly by its pixels.
+//[/comment]
+struct PixelStats
+{
+    float tests, shadowRays, depth, time;
+};
+
+//[comment]
+// Measures the cost of a pixel: the counters and the time between begin() and
+// end() are added to the pixel. The deepest ray is tracked for the pixel only,
+// the thread counter keeps its own maximum.
+//[/comment]
+class PixelProbe
+{
+public:
+    PixelProbe() : counters() {}
+    void begin()
+    {
+        counters = rayCounters;
+        rayCounters.depth = 0;
+        start = Clock::now();
+    }
+    void end(PixelStats &pixel)
+    {
+        pixel.time += seconds(start, Clock::now());
+        pixel.tests += rayCounters.tests - counters.tests;
+        pixel.shadowRays += rayCounters.shadowRays - counters.shadowRays;
+        pixel.depth = std::max(pixel.depth, float(rayCounters.depth));
+        rayCounters.depth = std::max(rayCounters.depth, counters.depth);
+    }
+private:
+    RayCounters counters;
+    Clock::time_point start;
+};
+
+//[comment]
+// Trace the primary rays of a tile in packets of SIZE x SIZE pixels. The packet
+// only finds the first hit of each ray: the reflection, refraction and shadow
+// rays spawned when shading the hit points go different ways and are traced
+// one by one by shade(). If times is not NULL, the time spent tracing the
+// packets and shading their hits is added to it, and if pixels is not NULL the
+// cost of every pixel is stored in it.
+//[/comment]
+template<unsigned SIZE, typename Material, typename Accelerator>
+void renderPackets(
+    const Tile &tile,
+    const PrimaryRays &primaryRay,
+    const SphereArray<Material> &spheres,
+    const std::vector<const Sphere<Material>*> &lights,
+    const Accelerator &bvh,
+    const float &cutoff,
+    Vec3f *image,
+    RenderTimes *times,
+    PixelStats *pixels)
+{
+    RayPacket<SIZE> packet;
+    packet.orig = primaryRay.origin;
+    for (unsigned y0 = tile.y0; y0 < tile.y1; y0 += SIZE) {
+        for (unsigned x0 = tile.x0; x0 < tile.x1; x0 += SIZE) {
+            Clock::time_point start, traced;
+            if (times) start = Clock::now();
+            PixelProbe probe;
+            PixelStats share = PixelStats();
+            if (pixels) probe.begin();
+            packet.active = 0;
+            for (unsigned i = 0; i < RayPacket<SIZE>::LANES; ++i) {
+                unsigned x = x0 + i % SIZE, y = y0 + i / SIZE;
+                bool inside = x < tile.x1 && y < tile.y1;
+                Vec3f raydir = inside ? primaryRay(x, y) : Vec3f(0, 0, -1);
+                packet.dx[i] = raydir.x, packet.dy[i] = raydir.y, packet.dz[i] = raydir.z;
+                if (inside) packet.active |= uint64_t(1) << i;
+            }
+            bvh.intersect(packet);
+            if (times) traced = Clock::now(), times->trace += seconds(start, traced);
+            if (pixels) {
+                probe.end(share);
+                float lanes = std::bitset<64>(packet.active).count();
+                share.tests /= lanes, share.time /= lanes;
+            }
+            for (unsigned i = 0; i < RayPacket<SIZE>::LANES; ++i) {
+                if (!(packet.active >> i & 1)) continue;
+                unsigned x = x0 + i % SIZE, y = y0 + i / SIZE;
+                Vec3f raydir(packet.dx[i], packet.dy[i], packet.dz[i]);
+                const Sphere<Material>* sphere = packet.sphere[i] == ~0u ? NULL : &spheres[packet.sphere[i]];
+                size_t pixel = primaryRay.pixel(x, y);
+                Random random(primaryRay.seed(x, y));
+                if (pixels) pixels[pixel] = share, probe.begin();
+                image[pixel] = shade(packet.orig, raydir, sphere, packet.tnear[i], lights, bvh, cutoff, primaryRay.spread, random);
+                if (pixels) probe.end(pixels[pixel]);
+            }
+            if (times) times->shade += seconds(traced, Clock::now());
+        }
+    }
+}
+
+//[comment]
+// Same as renderPackets() for rays traced one by one. Timing single rays costs
+// two clock reads per pixel, so the times are only a rough split in this mode.
+//[/comment]
+template<typename Material, typename Accelerator>
+void renderRays(
+    const Tile &tile,
+    const PrimaryRays &primaryRay,
+    const std::vector<const Sphere<Material>*> &lights,
+    const Accelerator &bvh,
+    const float &cutoff,
+    Vec3f *image,
+    RenderTimes *times,
+    PixelStats *pixels)
+{
+    const Vec3f &orig = primaryRay.origin;
+    const float &spread = primaryRay.spread;
+    for (unsigned y = tile.y0; y < tile.y1; ++y) {
+        size_t index = primaryRay.pixel(tile.x0, y);
+        Vec3f *pixel = image + index;
+        for (unsigned x = tile.x0; x < tile.x1; ++x, ++pixel, ++index) {
+            Random random(primaryRay.seed(x, y));
+            PixelProbe probe;
+            if (pixels) pixels[index] = PixelStats(), probe.begin();
+            if (!times) {
+                *pixel = trace(orig, primaryRay(x, y), lights, bvh, cutoff, spread, random);
+            }
+            else {
+                Clock::time_point start = Clock::now();
+                Vec3f raydir = primaryRay(x, y);
+                float tnear;
+                const Sphere<Material>* sphere = bvh.intersect(orig, raydir, tnear);
+                Clock::time_point traced = Clock::now();
+                *pixel = shade(orig, raydir, sphere, tnear, lights, bvh, cutoff, spread, random);
+                times->trace += seconds(start, traced);
+                times->shade += seconds(traced, Clock::now());
+            }
+            if (pixels) probe.end(pixels[index]);
+        }
+    }
+}
+
+//[comment]
+// Interleave the low 7 bits of x, y and z, so that cells close to each other in
+// space mostly get codes close to each other.
+//[/comment]
+inline uint32_t mortonCode(unsigned x, unsigned y, unsigned z)
+{
+    uint32_t code = 0;
+    for (unsigned b = 0; b < 7; ++b)
+        code |= (x >> b & 1) << (3 * b) | (y >> b & 1) << (3 * b + 1) | (z >> b & 1) << (3 * b + 2);
+    return code;
+}
+
+//[comment]
+// Same as renderRays() with the rays of the tile traced a bounce at a time
+// (--wavefront) instead of one pixel after the other. All the rays of a bounce
+// make a wave: the wave is sorted by the octant of the ray directions and by
+// the cell of the scene the rays start from, so that rays going the same way
+// from the same place walk the same nodes of the BVH one after the other. The
+// hits are then sorted by sphere, so that the rays hitting a sphere (and its
+// texture) are shaded together, and shading them makes the next wave.
+// The Russian roulette of a pixel draws its numbers in another order than
+// shade() does, so the image is only the same as the one of renderRays() on
+// average, and up to rounding with --cutoff 0.
+//[/comment]
+template<typename Material, typename Accelerator>
+void renderWavefront(
+    const Tile &tile,
+    const PrimaryRays &primaryRay,
+    const std::vector<const Sphere<Material>*> &lights,
+    const Accelerator &bvh,
+    const float &cutoff,
+    Vec3f *image,
+    RenderTimes *times)
+{
+    typedef typename QueuedRay<Material>::Cone Cone;
+    struct WaveRay : QueuedRay<Material>
+    {
+        unsigned pixel;                     /// pixel of the ray, counted from the top left corner of the tile
+        const Sphere<Material>* sphere;     /// closest hit or NULL
+        float tnear;
+    };
+    unsigned width = tile.x1 - tile.x0;
+    std::vector<Vec3f> colors(size_t(width) * (tile.y1 - tile.y0));
+    std::vector<Random> randoms;
+    std::vector<WaveRay> wave, next;
+    std::vector<uint64_t> order;
+    randoms.reserve(colors.size());
+    wave.reserve(colors.size());
+    for (unsigned y = tile.y0; y < tile.y1; ++y) {
+        for (unsigned x = tile.x0; x < tile.x1; ++x) {
+            WaveRay ray;
+            static_cast<QueuedRay<Material>&>(ray) =
+                QueuedRay<Material>(primaryRay.origin, primaryRay(x, y), Vec3f(1), 0, Cone(0, primaryRay.spread));
+            ray.pixel = unsigned(randoms.size());
+            wave.push_back(ray);
+            randoms.push_back(Random(primaryRay.seed(x, y)));
+        }
+    }
+    // the cells are 1/128 of the bounds of the scene along each axis
+    Vec3f low(0), cells(0);
+    AABB box = bvh.bounds();
+    if (box.bmin.x <= box.bmax.x) {
+        low = box.bmin;
+        Vec3f size = box.bmax - box.bmin;
+        cells = Vec3f(127.99f / std::max(size.x, 1e-6f), 127.99f / std::max(size.y, 1e-6f), 127.99f / std::max(size.z, 1e-6f));
+    }
+    auto cell = [&](float v, float l, float c) { return unsigned(std::min(127.f, std::max(0.f, (v - l) * c))); };
+    // the rays spawned while shading a ray of this pixel
+    unsigned pixel = 0;
+    auto enqueue = [&](const Vec3f &orig, const Vec3f &dir, Vec3f weight, int depth, const Cone &cone) {
+        float w = std::max(weight.x, std::max(weight.y, weight.z));
+        if (!(w > 0)) return; // this ray can't add anything to the pixel
+        if (w < cutoff) {
+            if (randoms[pixel].next() * cutoff >= w) return;
+            weight = weight * (cutoff / w);
+        }
+        WaveRay ray;
+        static_cast<QueuedRay<Material>&>(ray) = QueuedRay<Material>(orig, dir, weight, depth, cone);
+        ray.pixel = pixel;
+        next.push_back(ray);
+    };
+    while (!wave.empty()) {
+        Clock::time_point start, traced;
+        if (times) start = Clock::now();
+        // the sort key goes in the high 32 bits, the index of the ray in the low ones
+        order.resize(wave.size());
+        for (unsigned i = 0; i < wave.size(); ++i) {
+            const WaveRay &ray = wave[i];
+            uint32_t octant = (ray.dir.x < 0) | (ray.dir.y < 0) << 1 | (ray.dir.z < 0) << 2;
+            uint32_t key = octant << 21 | mortonCode(cell(ray.orig.x, low.x, cells.x), cell(ray.orig.y, low.y, cells.y),
+                cell(ray.orig.z, low.z, cells.z));
+            order[i] = uint64_t(key) << 32 | i;
+        }
+        std::sort(order.begin(), order.end());
+        for (unsigned i = 0; i < order.size(); ++i) {
+            WaveRay &ray = wave[uint32_t(order[i])];
+            ray.sphere = bvh.intersect(ray.orig, ray.dir, ray.tnear);
+            // the rays leaving the scene go last
+            order[i] = uint64_t(ray.sphere ? bvh.indexOf(ray.sphere) : ~0u) << 32 | uint32_t(order[i]);
+        }
+        std::sort(order.begin(), order.end());
+        if (times) traced = Clock::now(), times->trace += seconds(start, traced);
+        for (unsigned i = 0; i < order.size(); ++i) {
+            const WaveRay &ray = wave[uint32_t(order[i])];
+            pixel = ray.pixel;
+            shadeRay(ray, ray.sphere, ray.tnear, lights, bvh, enqueue, colors[pixel], (uint64_t*)NULL);
+        }
+        wave.swap(next);
+        next.clear();
+        if (times) times->shade += seconds(traced, Clock::now());
+    }
+    for (unsigned y = tile.y0; y < tile.y1; ++y)
+        std::copy(&colors[size_t(y - tile.y0) * width], &colors[size_t(y - tile.y0) * width] + width,
+            image + primaryRay.pixel(tile.x0, y));
+}
+
+//[comment]
+// Render a frame seen by camera, in image which holds the pixels of
+// camera.region(). We compute a camera ray for each pixel of the image
+// trace it and return a color. If the ray hits a sphere, we return the color of the
+// sphere at the intersection point, else we return the background color.
+// The pixels are traced tile by tile by options.numThreads threads (see TileScheduler).
+// If times is not NULL, the time spent in each phase is stored in it. Likewise
+// for the sums of the ray counters of the threads, and for the cost of every
+// pixel (see PixelStats). This renders spheres, lit by lights (see
+// findLights()), with bvh, a BVH or a UniformGrid built over them: the frames
+// of an animation reuse the same one. If done is not NULL, every tile is
+// pushed to it once its pixels are in image (see writeTiles()).
+//[/comment]
+template<typename Material, typename Accelerator>
+void renderFrame(const SphereArray<Material> &spheres, const std::vector<const Sphere<Material>*> &lights,
+    const Accelerator &bvh, const Camera &camera, const RenderOptions &options, WorkerPool &pool, Vec3f *image,
+    RenderTimes *times, RayCounters *counters, PixelStats *pixels, TileQueue *done = NULL)
+{
+    Clock::time_point start = Clock::now();
+    PrimaryRays primaryRay(camera);
+    TileScheduler scheduler(primaryRay.region, TILE_SIZE, pool.size());
+    Clock::time_point setup = Clock::now();
+    // every thread times and counts its own tiles, the sums are added up at the end
+    std::vector<RenderTimes> threadTimes(pool.size());
+    std::vector<RayCounters> threadCounters(pool.size());
+    auto worker = [&](unsigned id) {
+        RenderTimes local, *t = times ? &local : NULL;
+        rayCounters = RayCounters();
+        Tile tile;
+        while (scheduler.next(id, tile)) {
+            // Trace rays
+            if (options.wavefront) {
+                renderWavefront(tile, primaryRay, lights, bvh, options.cutoff, image, t);
+            }
+            else if (options.packetSize == 8) {
+                renderPackets<8>(tile, primaryRay, spheres, lights, bvh, options.cutoff, image, t, pixels);
+            }
+            else if (options.packetSize == 4) {
+                renderPackets<4>(tile, primaryRay, spheres, lights, bvh, options.cutoff, image, t, pixels);
+            }
+            else {
+                renderRays(tile, primaryRay, lights, bvh, options.cutoff, image, t, pixels);
+            }
+            if (done) done->push(tile);
+        }
+        threadTimes[id] = local;
+        threadCounters[id] = rayCounters;
+    };
+    pool.run(worker);
+    if (times) {
+        *times = RenderTimes();
+        times->setup = seconds(start, setup);
+        times->render = seconds(setup, Clock::now());
+        for (unsigned i = 0; i < threadTimes.size(); ++i) {
+            times->trace += threadTimes[i].trace;
+            times->shade += threadTimes[i].shade;
+        }
+    }
+    if (counters) {
+        *counters = RayCounters();
+        for (unsigned i = 0; i < threadCounters.size(); ++i) {
+            counters->rays += threadCounters[i].rays;
+            counters->tests += threadCounters[i].tests;
+            counters->shadowRays += threadCounters[i].shadowRays;
+            counters->depth = std::max(counters->depth, threadCounters[i].depth);
+        }
+    }
+}
+
+//[comment]
+// Whether to render scene with a UniformGrid rather than a BVH. That's the
+// choice of --accelerator, or with --accelerator auto, for animations with at
+// least GRID_MIN_SPHERES spheres, most of them moving, which suit a grid (see
+// UniformGrid::suited()): refitting a BVH to them soon makes it slow, and
+// building a new one every frame costs more than the grid saves.
+//[/comment]
+#define GRID_MIN_SPHERES 10000
+
+template<typename Material>
+bool useGrid(const Scene<Material> &scene, const RenderOptions &options)
+{
+    if (options.accelerator != ACCELERATOR_AUTO) return options.accelerator == ACCELERATOR_GRID;
+    if (scene.spheres.size() < GRID_MIN_SPHERES) return false;
+    size_t moving = 0;
+    for (size_t i = 0; i < scene.motions.size(); ++i)
+        moving += scene.motions[i].spin != 0 || scene.motions[i].velocity.length2() > 0;
+    return 2 * moving > scene.spheres.size() && UniformGrid<Material>::suited(scene.spheres);
+}
+
+//[comment]
+// Same as above for a scene, whose accelerator is built (unless the scene
+// comes with a BVH) and lights are found as part of the setup time.
+//[/comment]
+template<typename Material>
+void renderFrame(const Scene<Material> &scene, const Camera &camera, const RenderOptions &options, WorkerPool &pool,
+    Vec3f *image, RenderTimes *times, RayCounters *counters, PixelStats *pixels, TileQueue *done = NULL)
+{
+    Clock::time_point start = Clock::now();
+    std::vector<const Sphere<Material>*> lights = findLights(scene.spheres);
+    if (useGrid(scene, options)) {
+        UniformGrid<Material> grid(scene.spheres, pool);
+        double build = seconds(start, Clock::now());
+        renderFrame(scene.spheres, lights, grid, camera, options, pool, image, times, counters, pixels, done);
+        if (times) times->setup += build;
+        return;
+    }
+    BVH<Material> bvh = scene.nodes.empty() ? BVH<Material>(scene.spheres, options.kernel) :
+        BVH<Material>(scene.spheres, options.kernel, scene.nodes, scene.slots);
+    double build = seconds(start, Clock::now());
+    renderFrame(scene.spheres, lights, bvh, camera, options, pool, image, times, counters, pixels, done);
+    if (times) times->setup += build;
+}
+
+//[comment]
+// Output stage of a render: save the image of region to a file while it is
+// traced, the tiles being popped from done as the render threads finish them.
+// This thread alone quantizes the tiles, and encodes and writes the bands of
+// TILE_SIZE rows in order as soon as all their tiles are in, so only the last
+// band is left to write once the last tile is traced. Returns false if the
+// file can't be written.
+//[/comment]
+inline bool writeTiles(const std::string &filename, ImageFormat format, const Vec3f *image, const Tile &region,
+    TileQueue &done)
+{
+    unsigned width = region.x1 - region.x0, height = region.y1 - region.y0;
+    std::vector<unsigned char> rgb(size_t(width) * height * 3), encoded;
+    // pixels still to come in every band
+    std::vector<unsigned> missing((height + TILE_SIZE - 1) / TILE_SIZE);
+    for (unsigned b = 0; b < missing.size(); ++b) missing[b] = width * std::min(unsigned(TILE_SIZE), height - b * TILE_SIZE);
+    // keep these flags if you compile under Windows
+    std::ofstream ofs(filename.c_str(), std::ios::out | std::ios::binary);
+    ImageEncoder encoder(format, width, height, encoded);
+    unsigned next = 0;
+    Tile tile;
+    while (done.pop(tile)) {
+        unsigned w = tile.x1 - tile.x0;
+        for (unsigned y = tile.y0; y < tile.y1; ++y) {
+            size_t i = size_t(y - region.y0) * width + tile.x0 - region.x0;
+            quantize(image + i, w, &rgb[3 * i]);
+        }
+        missing[(tile.y0 - region.y0) / TILE_SIZE] -= w * (tile.y1 - tile.y0);
+        for (; next < missing.size() && !missing[next]; ++next)
+            encoder.addRows(&rgb[size_t(next) * TILE_SIZE * width * 3], std::min(unsigned(TILE_SIZE), height - next * TILE_SIZE));
+        ofs.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+        encoded.clear();
+    }
+    encoder.finish();
+    ofs.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+    return bool(ofs);
+}
+
+//[comment]
+// Name of a file saved along with the output file: the name of the output file
+// with name before the extension (untitled.tests.ppm for untitled.ppm and the
+// tests heatmap, untitled.0001.ppm for frame 1 of an animation)
+//[/comment]
+inline std::string derivedFilename(const std::string &output, const std::string &name)
+{
+    size_t dot = output.rfind('.'), slash = output.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = output.size();
+    return output.substr(0, dot) + "." + name + output.substr(dot);
+}
+
+//[comment]
+// Save the heatmaps of the cost of the pixels next to the image: one for the
+// intersection tests, the shadow rays, the depth of the rays and the time per
+// pixel. The values are shown in false colors, from black (no cost) through
+// blue, cyan, green and yellow to red for the 99th percentile and above, so a
+// few very expensive pixels don't make the rest of the map dark. Returns false
+// if one of them can't be written.
+//[/comment]
+inline bool writeHeatmaps(const std::string &output, ImageFormat format, const std::vector<PixelStats> &pixels,
+    unsigned width, unsigned height)
+{
+    static const Vec3f colors[] = { Vec3f(0, 0, 0), Vec3f(0, 0, 1), Vec3f(0, 1, 1), Vec3f(0, 1, 0), Vec3f(1, 1, 0), Vec3f(1, 0, 0) };
+    const unsigned numColors = sizeof(colors) / sizeof(colors[0]);
+    const char *names[] = { "tests", "shadow", "depth", "time" };
+    std::vector<float> values(pixels.size());
+    std::vector<Vec3f> image(pixels.size());
+    bool written = true;
+    for (unsigned k = 0; k < 4; ++k) {
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            const PixelStats &p = pixels[i];
+            values[i] = k == 0 ? p.tests : k == 1 ? p.shadowRays : k == 2 ? p.depth : p.time;
+        }
+        std::vector<float> sorted(values);
+        std::sort(sorted.begin(), sorted.end());
+        float scale = sorted.empty() ? 0 : sorted[sorted.size() * 99 / 100];
+        scale = scale > 0 ? (numColors - 1) / scale : 0;
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            float v = std::min(values[i] * scale, float(numColors - 1));
+            unsigned c = std::min(unsigned(v), numColors - 2);
+            image[i] = colors[c] * (c + 1 - v) + colors[c + 1] * (v - c);
+        }
+        std::string filename = derivedFilename(output, names[k]);
+        if (!writeImage(filename, format, image.data(), width, height)) {
+            std::cerr << "Can't write image " << filename << std::endl;
+            written = false;
+        }
+    }
+    return written;
+}
+
+//[comment]
+// Running estimate of a pixel in progressive mode: the sum of the colors of its
+// samples, and the sum and sum of squares of their luminance (clamped to the
+// displayable range, errors above white don't show) to estimate the variance.
+// When denoising, the first hits of the samples are summed too: their normal
+// (zero for the rays leaving the scene), albedo (the color of the surface,
+// white for the background) and distance.
+//[/comment]
+struct PixelEstimate
+{
+    Vec3f sum;
+    double lumSum, lumSum2;
+    unsigned samples;
+    bool converged;
+    Vec3f normalSum, albedoSum;
+    float depthSum;
+    unsigned hits;                          /// samples whose first ray hit a sphere
+};
+
+//[comment]
+// Denoiser of progressive renders (--denoise): an edge-avoiding a-trous
+// wavelet filter (Dammertz et al. 2010) with the variance guided color weights
+// of SVGF (Schied et al. 2017). Each of the ITERATIONS passes blurs the image
+// with a 5x5 B3 spline kernel whose taps are 1, 2, 4, 8 then 16 pixels apart,
+// so the last pass covers 129x129 pixels, and weights every tap by how much
+// it differs from the center pixel:
+// - the normals at the first hits, so the filter stops at the silhouettes and
+//   creases of the spheres,
+// - the distances of the first hits, relative to the distance of the center,
+//   which separates spheres in front of each other,
+// - the colors, relative to their standard error: noise gets smoothed, but the
+//   edges of shadows and reflections, many times brighter than the noise, stay.
+// The lighting is filtered rather than the color (the color divided by the
+// albedo of the first hits), so the textures stay sharp, and the variance is
+// filtered along with it.
+//
+// The passes are run by the threads of a WorkerPool, a band of rows per job.
+// The weights use no exp() or pow(), so the AVX2 version (for 8 pixels whose
+// taps are all inside the image) does the same float operations as the scalar
+// one and gives the same image.
+//[/comment]
+class Denoiser
+{
+public:
+    enum { ITERATIONS = 5 };
+    Denoiser(unsigned width, unsigned height) : w(width), h(height)
+    {
+        for (unsigned k = 0; k < 4; ++k) planes[0][k].resize(size_t(w) * h), planes[1][k].resize(size_t(w) * h);
+        for (unsigned k = 0; k < 7; ++k) guide[k].resize(size_t(w) * h);
+    }
+    //[comment]
+    // Pixel i: its color and the variance of its luminance, and the mean
+    // normal, albedo and distance of its first hits
+    //[/comment]
+    void set(size_t i, const Vec3f &color, float variance, const Vec3f &normal, const Vec3f &albedo, float depth)
+    {
+        const float ALBEDO_MIN = 0.01;
+        Vec3f a(std::max(albedo.x, ALBEDO_MIN), std::max(albedo.y, ALBEDO_MIN), std::max(albedo.z, ALBEDO_MIN));
+        float lum = 0.2126 * a.x + 0.7152 * a.y + 0.0722 * a.z;
+        planes[0][0][i] = color.x / a.x, planes[0][1][i] = color.y / a.y, planes[0][2][i] = color.z / a.z;
+        planes[0][3][i] = variance / (lum * lum);
+        guide[0][i] = normal.x, guide[1][i] = normal.y, guide[2][i] = normal.z, guide[3][i] = depth;
+        guide[4][i] = a.x, guide[5][i] = a.y, guide[6][i] = a.z;
+    }
+    //[comment]
+    // Filter the image and store it in image, with the AVX2 version if simd is
+    // set and the CPU has it
+    //[/comment]
+    void run(WorkerPool &pool, bool simd, Vec3f *image)
+    {
+#ifdef HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        simd = simd && __builtin_cpu_supports("avx2");
+#else
+        simd = false;
+#endif
+        std::vector<Tile> bands;
+        for (unsigned y = 0; y < h; y += 4) bands.push_back(Tile{ 0, y, w, std::min(y + 4, h) });
+        unsigned current = 0;
+        for (unsigned i = 0; i < ITERATIONS; ++i, current ^= 1) {
+            TileScheduler scheduler(bands, pool.size());
+            pool.run([&](unsigned id) {
+                Tile band;
+                while (scheduler.next(id, band)) {
+                    for (unsigned y = band.y0; y < band.y1; ++y)
+                        filterRow(planes[current], planes[current ^ 1], y, 1 << i, simd);
+                }
+            });
+        }
+        for (size_t p = 0; p < size_t(w) * h; ++p) {
+            image[p] = Vec3f(planes[current][0][p] * guide[4][p], planes[current][1][p] * guide[5][p],
+                planes[current][2][p] * guide[6][p]);
+        }
+    }
+private:
+    typedef std::vector<float, AlignedAllocator<float> > Plane;
+    unsigned w, h;
+    Plane planes[2][4];                     /// lighting (r, g, b) and its variance, read from one and filtered into the other
+    Plane guide[7];                         /// normal (x, y, z), distance and albedo (r, g, b) of the first hits
+    static constexpr float SIGMA_COLOR2 = 64; // squared number of standard errors a color may be off by
+    static constexpr float SIGMA_DEPTH2 = 0.02f * 0.02f; // squared relative distance tolerated per pixel
+    // weights of the taps 0, 1 and 2 pixels (times the step) from the center
+    static float kernel(int d) { return d == 0 ? 3 / 8.f : d == 1 || d == -1 ? 1 / 4.f : 1 / 16.f; }
+
+    void filterRow(const Plane *in, Plane *out, unsigned y, unsigned step, bool simd) const
+    {
+        unsigned x = 0;
+#ifdef HAVE_X86_KERNELS
+        // the pixels whose taps are all in the row
+        if (simd) {
+            for (; x < 2 * step && x < w; ++x) filterPixel(in, out, x, y, step);
+            for (; x + 8 + 2 * step <= w; x += 8) filterPixels8(in, out, x, y, step);
+        }
+#else
+        (void)simd;
+#endif
+        for (; x < w; ++x) filterPixel(in, out, x, y, step);
+    }
+
+    EXACT_FP void filterPixel(const Plane *in, Plane *out, unsigned x, unsigned y, unsigned step) const
+    {
+        size_t p = size_t(y) * w + x;
+        float r = in[0][p], g = in[1][p], b = in[2][p], nx = guide[0][p], ny = guide[1][p], nz = guide[2][p], z = guide[3][p];
+        float invColor = 1 / (SIGMA_COLOR2 * in[3][p] + 1e-6f);
+        float depthScale = SIGMA_DEPTH2 * float(step) * float(step), invDepth = 1 / (depthScale * z * z + 1e-6f);
+        float center = kernel(0) * kernel(0), weights = center;
+        float sr = center * r, sg = center * g, sb = center * b, sv = center * center * in[3][p];
+        for (int dy = -2; dy <= 2; ++dy) {
+            int qy = int(y) + dy * int(step);
+            if (qy < 0 || qy >= int(h)) continue;
+            for (int dx = -2; dx <= 2; ++dx) {
+                int qx = int(x) + dx * int(step);
+                if ((dx == 0 && dy == 0) || qx < 0 || qx >= int(w)) continue;
+                size_t q = size_t(qy) * w + qx;
+                float dr = r - in[0][q], dg = g - in[1][q], db = b - in[2][q], dz = z - guide[3][q];
+                float e = (dr * dr + dg * dg + db * db) * invColor + dz * dz * invDepth;
+                // exp(-e) as (1 - e / 256)^256
+                float t = std::max(1 - e * (1 / 256.f), 0.f);
+                for (int k = 0; k < 8; ++k) t = t * t;
+                // the cosine between the normals to the power 128
+                float c = std::max(nx * guide[0][q] + ny * guide[1][q] + nz * guide[2][q], 0.f);
+                for (int k = 0; k < 7; ++k) c = c * c;
+                float weight = kernel(dx) * kernel(dy) * c * t;
+                weights += weight;
+                sr += weight * in[0][q], sg += weight * in[1][q], sb += weight * in[2][q];
+                sv += weight * weight * in[3][q];
+            }
+        }
+        out[0][p] = sr / weights, out[1][p] = sg / weights, out[2][p] = sb / weights;
+        out[3][p] = sv / (weights * weights);
+    }
+
+#ifdef HAVE_X86_KERNELS
+    __attribute__((target("avx2"))) EXACT_FP
+    void filterPixels8(const Plane *in, Plane *out, unsigned x, unsigned y, unsigned step) const
+    {
+        size_t p = size_t(y) * w + x;
+        const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1), epsilon = _mm256_set1_ps(1e-6f);
+        __m256 r = _mm256_loadu_ps(&in[0][p]), g = _mm256_loadu_ps(&in[1][p]), b = _mm256_loadu_ps(&in[2][p]);
+        __m256 v = _mm256_loadu_ps(&in[3][p]);
+        __m256 nx = _mm256_loadu_ps(&guide[0][p]), ny = _mm256_loadu_ps(&guide[1][p]), nz = _mm256_loadu_ps(&guide[2][p]);
+        __m256 z = _mm256_loadu_ps(&guide[3][p]);
+        __m256 invColor = _mm256_div_ps(one, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(SIGMA_COLOR2), v), epsilon));
+        __m256 depthScale = _mm256_set1_ps(SIGMA_DEPTH2 * float(step) * float(step));
+        __m256 invDepth = _mm256_div_ps(one, _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(depthScale, z), z), epsilon));
+        __m256 center = _mm256_set1_ps(kernel(0) * kernel(0)), weights = center;
+        __m256 sr = _mm256_mul_ps(center, r), sg = _mm256_mul_ps(center, g), sb = _mm256_mul_ps(center, b);
+        __m256 sv = _mm256_mul_ps(_mm256_mul_ps(center, center), v);
+        for (int dy = -2; dy <= 2; ++dy) {
+            int qy = int(y) + dy * int(step);
+            if (qy < 0 || qy >= int(h)) continue;
+            for (int dx = -2; dx <= 2; ++dx) {
+                if (dx == 0 && dy == 0) continue;
+                size_t q = size_t(qy) * w + x + dx * int(step);
+                __m256 qr = _mm256_loadu_ps(&in[0][q]), qg = _mm256_loadu_ps(&in[1][q]), qb = _mm256_loadu_ps(&in[2][q]);
+                __m256 dr = _mm256_sub_ps(r, qr), dg = _mm256_sub_ps(g, qg), db = _mm256_sub_ps(b, qb);
+                __m256 dz = _mm256_sub_ps(z, _mm256_loadu_ps(&guide[3][q]));
+                __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)), _mm256_mul_ps(db, db));
+                __m256 e = _mm256_add_ps(_mm256_mul_ps(d2, invColor), _mm256_mul_ps(_mm256_mul_ps(dz, dz), invDepth));
+                __m256 t = _mm256_max_ps(_mm256_sub_ps(one, _mm256_mul_ps(e, _mm256_set1_ps(1 / 256.f))), zero);
+                for (int k = 0; k < 8; ++k) t = _mm256_mul_ps(t, t);
+                __m256 c = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, _mm256_loadu_ps(&guide[0][q])),
+                    _mm256_mul_ps(ny, _mm256_loadu_ps(&guide[1][q]))), _mm256_mul_ps(nz, _mm256_loadu_ps(&guide[2][q])));
+                c = _mm256_max_ps(c, zero);
+                for (int k = 0; k < 7; ++k) c = _mm256_mul_ps(c, c);
+                __m256 weight = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(kernel(dx) * kernel(dy)), c), t);
+                weights = _mm256_add_ps(weights, weight);
+                sr = _mm256_add_ps(sr, _mm256_mul_ps(weight, qr));
+                sg = _mm256_add_ps(sg, _mm256_mul_ps(weight, qg));
+                sb = _mm256_add_ps(sb, _mm256_mul_ps(weight, qb));
+                sv = _mm256_add_ps(sv, _mm256_mul_ps(_mm256_mul_ps(weight, weight), _mm256_loadu_ps(&in[3][q])));
+            }
+        }
+        _mm256_storeu_ps(&out[0][p], _mm256_div_ps(sr, weights));
+        _mm256_storeu_ps(&out[1][p], _mm256_div_ps(sg, weights));
+        _mm256_storeu_ps(&out[2][p], _mm256_div_ps(sb, weights));
+        _mm256_storeu_ps(&out[3][p], _mm256_div_ps(sv, _mm256_mul_ps(weights, weights)));
+    }
+#endif
+};
+
+//[comment]
+// Progressive rendering. Instead of one ray through the center of every pixel,
+// each pass adds one sample at a random position inside every pixel which has
+// not converged yet, and the pixel color is the mean of its samples (which
+// antialiases the edges). A pixel is converged once it has at least
+// MIN_SAMPLES samples and the standard error of its mean luminance drops below
+// options.threshold, so the passes concentrate on the edges, the reflections
+// and the refractions while the flat areas stop early. Rendering stops after
+// options.passes passes, once every pixel has converged, or when a pass
+// finishes after options.timeBudget seconds (if not 0). The image is saved
+// after every pass, so it can be watched as it refines. With options.denoise,
+// the image of the last pass is denoised (see Denoiser) and saved again.
+// Returns false if the last image can't be written.
+//[/comment]
+template<typename Material>
+bool renderProgressive(const Scene<Material> &scene, const Camera &camera, const RenderOptions &options, WorkerPool &pool,
+    Vec3f *image)
+{
+    const SphereArray<Material> &spheres = scene.spheres;
+    const unsigned MIN_SAMPLES = 4;
+    Clock::time_point start = Clock::now();
+    bool written = true;
+    PrimaryRays primaryRay(camera);
+    const uint32_t numPixels = camera.imageWidth() * camera.imageHeight(), passSeeds = camera.width * camera.height;
+    BVH<Material> bvh = scene.nodes.empty() ? BVH<Material>(spheres, options.kernel) :
+        BVH<Material>(spheres, options.kernel, scene.nodes, scene.slots);
+    std::vector<const Sphere<Material>*> lights = findLights(spheres);
+    std::vector<PixelEstimate> estimates(numPixels, PixelEstimate());
+    unsigned active = numPixels, pass = 0;
+    uint64_t samples = 0;
+    while (pass < options.passes && active) {
+        TileScheduler scheduler(primaryRay.region, TILE_SIZE, pool.size());
+        auto worker = [&](unsigned id) {
+            Tile tile;
+            while (scheduler.next(id, tile)) {
+                for (unsigned y = tile.y0; y < tile.y1; ++y) {
+                    for (unsigned x = tile.x0; x < tile.x1; ++x) {
+                        PixelEstimate &estimate = estimates[primaryRay.pixel(x, y)];
+                        if (estimate.converged) continue;
+                        // a different sequence for every pixel and pass
+                        Random random(primaryRay.seed(x, y) + pass * passSeeds);
+                        float dx = random.next(), dy = random.next();
+                        Vec3f raydir = primaryRay(x, y, dx, dy);
+                        float tnear;
+                        const Sphere<Material>* sphere = bvh.intersect(primaryRay.origin, raydir, tnear);
+                        Vec3f color = shade(primaryRay.origin, raydir, sphere, tnear, lights, bvh, options.cutoff,
+                            primaryRay.spread, random);
+                        if (options.denoise && sphere) {
+                            Vec3f phit = primaryRay.origin + raydir * tnear, nhit = phit - sphere->center;
+                            Math::normalize(nhit);
+                            if (raydir.dot(nhit) > 0) nhit = -nhit;
+                            // the footprint of shadeRay()
+                            float footprint = primaryRay.spread * tnear / std::max(0.05f, -raydir.dot(nhit));
+                            estimate.normalSum += nhit;
+                            estimate.albedoSum += sphere->getColor(phit, footprint);
+                            estimate.depthSum += tnear;
+                            ++estimate.hits;
+                        }
+                        else if (options.denoise) {
+                            estimate.albedoSum += Vec3f(1);
+                        }
+                        float lum = 0.2126 * std::min(float(1), color.x) + 0.7152 * std::min(float(1), color.y) +
+                            0.0722 * std::min(float(1), color.z);
+                        estimate.sum += color;
+                        estimate.lumSum += lum;
+                        estimate.lumSum2 += lum * lum;
+                        unsigned n = ++estimate.samples;
+                        if (n >= MIN_SAMPLES) {
+                            double mean = estimate.lumSum / n;
+                            double variance = std::max(0., (estimate.lumSum2 - n * mean * mean) / (n - 1));
+                            estimate.converged = variance <= options.threshold * options.threshold * n;
+                        }
+                    }
+                }
+            }
+        };
+        pool.run(worker);
+        samples += active;
+        ++pass;
+        active = 0;
+        for (unsigned i = 0; i < numPixels; ++i) {
+            image[i] = estimates[i].sum * (1 / float(estimates[i].samples));
+            active += !estimates[i].converged;
+        }
+        double elapsed = seconds(start, Clock::now());
+        std::cerr << "pass " << pass << ": " << active << " pixels left, " << float(samples) / numPixels <<
+            " samples per pixel, " << elapsed << " s" << std::endl;
+        // preview
+        written = writeImage(options.output, options.format, image, camera.imageWidth(), camera.imageHeight());
+        if (!written) std::cerr << "Can't write image " << options.output << std::endl;
+        if (options.timeBudget > 0 && elapsed >= options.timeBudget) break;
+    }
+    if (options.denoise) {
+        Clock::time_point denoising = Clock::now();
+        Denoiser denoiser(camera.imageWidth(), camera.imageHeight());
+        for (unsigned i = 0; i < numPixels; ++i) {
+            const PixelEstimate &estimate = estimates[i];
+            unsigned n = estimate.samples;
+            double mean = estimate.lumSum / n;
+            // the variance of the mean
+            double variance = n > 1 ? std::max(0., (estimate.lumSum2 - n * mean * mean) / (n - 1)) / n : 0;
+            denoiser.set(i, image[i], variance, estimate.normalSum * (1 / float(n)), estimate.albedoSum * (1 / float(n)),
+                estimate.hits ? estimate.depthSum / estimate.hits : 0);
+        }
+        denoiser.run(pool, options.kernel != intersectScalar, image);
+        std::cerr << "denoised in " << seconds(denoising, Clock::now()) << " s" << std::endl;
+        written = writeImage(options.output, options.format, image, camera.imageWidth(), camera.imageHeight());
+        if (!written) std::cerr << "Can't write image " << options.output << std::endl;
+    }
+    return written;
+}
+
+#ifdef RAYTRACER_OFFLOAD
+// GPU offload of render(), see offload.h
+template<typename Material>
+bool renderOffload(const Scene<Material> &scene, const Camera &camera, const RenderOptions &options, Vec3f *image);
+#endif
+
+//[comment]
+// Main rendering function: render the scene and save the result to a PPM or
+// PNG image, along with the heatmaps if options.heatmap is set. With
+// options.passes set, the scene is rendered progressively instead. The scene
+// is seen by its camera. The image is rendered by the threads of pool in
+// framebuffer, which can both be reused from render to render, or on the GPU
+// with options.offload (see renderOffload()) when it can be. Images rendered
+// on the CPU are written by another thread while they are traced (see
+// writeTiles()). Returns false if the image or a heatmap can't be written.
+//[/comment]
+template<typename Material>
+bool render(const Scene<Material> &scene, const RenderOptions &options, WorkerPool &pool, Framebuffer &framebuffer)
+{
+    const Camera &camera = scene.camera;
+    unsigned width = camera.imageWidth(), height = camera.imageHeight();
+    framebuffer.resize(width, height);
+    Vec3f *image = framebuffer.data();
+    if (options.passes) {
+        // saves the image after every pass
+        return renderProgressive(scene, camera, options, pool, image);
+    }
+    else {
+        std::vector<PixelStats> pixels(options.heatmap ? width * height : 0);
+        bool offloaded = false;
+#ifdef RAYTRACER_OFFLOAD
+        if (options.offload) offloaded = renderOffload(scene, camera, options, image);
+#endif
+        bool written;
+        if (offloaded) {
+            written = writeImage(options.output, options.format, image, width, height);
+        }
+        else {
+            Tile region = camera.region();
+            TileQueue done(splitTiles(region, TILE_SIZE).size());
+            std::future<bool> writing = std::async(std::launch::async, [&]() {
+                return writeTiles(options.output, options.format, image, region, done);
+            });
+            renderFrame(scene, camera, options, pool, image, NULL, NULL, options.heatmap ? pixels.data() : NULL, &done);
+            written = writing.get();
+        }
+        if (!written) std::cerr << "Can't write image " << options.output << std::endl;
+        if (options.heatmap) written = writeHeatmaps(options.output, options.format, pixels, width, height) && written;
+        return written;
+    }
+}
+
+//[comment]
+// Batch rendering of the frames first to last of an animation (see
+// SphereMotion), frame f being saved to the output file numbered f (see
+// derivedFilename()). The process, the textures, the render threads and the
+// BVH are the same for all the frames: after the first one, the BVH is refit
+// to the spheres where they moved (and built again only once refitting made
+// it too slow). Scenes in which most spheres move get a UniformGrid instead
+// (see useGrid()), built again every frame. While a frame is traced, the
+// previous one is encoded and written by another thread, from the other of
+// two framebuffers. Returns false if a frame can't be written.
+//[/comment]
+template<typename Material>
+bool renderAnimation(Scene<Material> &scene, const RenderOptions &options, WorkerPool &pool, unsigned first,
+    unsigned last)
+{
+    SphereArray<Material> &spheres = scene.spheres;
+    const Camera &camera = scene.camera;
+    unsigned width = camera.imageWidth(), height = camera.imageHeight();
+    std::vector<Vec3f> rest;
+    for (unsigned i = 0; i < scene.motions.size(); ++i) rest.push_back(spheres[i].center);
+    auto animate = [&](unsigned frame) {
+        for (unsigned i = 0; i < scene.motions.size(); ++i) spheres[i].center = scene.motions[i].position(rest[i], frame);
+    };
+    animate(first);
+    std::unique_ptr<BVH<Material> > bvh;
+    std::unique_ptr<UniformGrid<Material> > grid;
+    if (useGrid(scene, options)) {
+        grid.reset(new UniformGrid<Material>(spheres, pool));
+    }
+    else {
+        // the prebuilt BVH of the scene is for the spheres at rest
+        bvh.reset(scene.nodes.empty() ? new BVH<Material>(spheres, options.kernel) :
+            new BVH<Material>(spheres, options.kernel, scene.nodes, scene.slots));
+        if (!scene.motions.empty() && !scene.nodes.empty() && !bvh->refit())
+            bvh.reset(new BVH<Material>(spheres, options.kernel));
+    }
+    std::vector<const Sphere<Material>*> lights = findLights(spheres);
+    Framebuffer framebuffers[2];
+    std::future<bool> writing;
+    bool written = true;
+    for (unsigned frame = first; frame <= last; ++frame) {
+        Clock::time_point start = Clock::now();
+        if (frame != first && !scene.motions.empty()) {
+            animate(frame);
+            if (grid) grid->build(pool);
+            else if (!bvh->refit()) bvh.reset(new BVH<Material>(spheres, options.kernel));
+        }
+        double update = seconds(start, Clock::now());
+        Framebuffer &framebuffer = framebuffers[frame % 2];
+        framebuffer.resize(width, height);
+        RenderTimes times;
+        if (grid) renderFrame(spheres, lights, *grid, camera, options, pool, framebuffer.data(), &times, NULL, NULL);
+        else renderFrame(spheres, lights, *bvh, camera, options, pool, framebuffer.data(), &times, NULL, NULL);
+        // the framebuffer of the next frame is the one the previous frame is written from
+        if (writing.valid()) written = writing.get() && written;
+        char number[16];
+        snprintf(number, sizeof(number), "%04u", frame);
+        std::string filename = derivedFilename(options.output, number);
+        writing = std::async(std::launch::async, [&options, &framebuffer, filename, width, height]() {
+            if (writeImage(filename, options.format, framebuffer.data(), width, height)) return true;
+            std::cerr << "Can't write image " << filename << std::endl;
+            return false;
+        });
+        std::cerr << "frame " << frame << ": " << seconds(start, Clock::now()) << " s (moving the spheres and " <<
+            (grid ? "building the grid " : "refitting ") << update << " s)" << std::endl;
+    }
+    if (writing.valid()) written = writing.get() && written;
+    return written;
+}
+
+//[comment]
+// The scenes which can be rendered. "default" is the scene of the tutorial,
+// composed of 5 spheres and 1 light (which is also a sphere). The other ones
+// are generated to stress the renderer: "spheres1k", "spheres100k" and
+// "spheres1m" fill the view with 1000, 100000 and 1000000 random spheres (a mix
+// of diffuse, reflective and transparent ones) while "reflective" and
+// "transparent" use 10000 spheres which all reflect or all refract. They all
+// have the ground and the light of the default scene and are the same from run
+// to run. In the default scene the big sphere in the middle is textured with
+// angad_texture.ppm, which only shows with a textured material. Returns false
+// if the scene name is unknown.
+//[/comment]
+template<typename Material>
+bool buildScene(const std::string &name, typename Material::Library &library, SphereArray<Material> &spheres)
+{
+    spheres.clear();
+    // position, radius, surface color, reflectivity, transparency, emission color
+    Sphere<Material> ground(Vec3f( 0.0, -10004, -20), 10000, Vec3f(0.20, 0.20, 0.20), 0, 0.0);
+    Sphere<Material> light(Vec3f( 0.0,     20, -30),     3, Vec3f(0.00, 0.00, 0.00), 0, 0.0, Vec3f(3));
+    if (name == "default") {
+        spheres.push_back(ground);
+        spheres.push_back(Sphere<Material>(Vec3f( 0.0,      0, -20),     4, Vec3f(1.00, 0.32, 0.36), 1, 0.5, Vec3f(0),
+            library.get("angad_texture.ppm")));
+        spheres.push_back(Sphere<Material>(Vec3f( 5.0,     -1, -15),     2, Vec3f(0.90, 0.76, 0.46), 1, 0.0));
+        spheres.push_back(Sphere<Material>(Vec3f( 5.0,      0, -25),     3, Vec3f(0.65, 0.77, 0.97), 1, 0.0));
+        spheres.push_back(Sphere<Material>(Vec3f(-5.5,      0, -15),     3, Vec3f(0.90, 0.90, 0.90), 1, 0.0));
+        spheres.push_back(light);
+        return true;
+    }
+    unsigned count;
+    if (name == "spheres1k") count = 1000;
+    else if (name == "spheres100k") count = 100000;
+    else if (name == "spheres1m") count = 1000000;
+    else if (name == "reflective" || name == "transparent") count = 10000;
+    else return false;
+    // the spheres fill about 5% of a box in front of the camera
+    const Vec3f boxMin(-12, -4, -60), boxMax(12, 8, -12);
+    Vec3f extent = boxMax - boxMin;
+    float radius = cbrt(0.05 * extent.x * extent.y * extent.z / (count * 4 / 3. * M_PI));
+    Random random(count);
+    spheres.reserve(count + 2);
+    spheres.push_back(ground);
+    for (unsigned i = 0; i < count; ++i) {
+        Vec3f center = boxMin + Vec3f(random.next(), random.next(), random.next()) * extent;
+        Vec3f color(0.2 + 0.8 * random.next(), 0.2 + 0.8 * random.next(), 0.2 + 0.8 * random.next());
+        float r = radius * (0.5 + random.next()), kind = random.next();
+        float reflection = 0, transparency = 0;
+        if (name == "reflective") reflection = 1;
+        else if (name == "transparent") reflection = 1, transparency = 0.5;
+        else if (kind < 0.3) reflection = 1;
+        else if (kind < 0.5) reflection = 1, transparency = 0.5;
+        spheres.push_back(Sphere<Material>(center, r, color, reflection, transparency));
+    }
+    spheres.push_back(light);
+    return true;
+}
+
+//[comment]
+// Apply camera settings (see Camera::parse()) to camera. Returns false, after
+// printing why, if they are invalid.
+//[/comment]
+inline bool setCamera(const std::string &settings, Camera &camera)
+{
+    std::istringstream in(settings);
+    std::string keyword;
+    while (in >> keyword) {
+        if (!camera.parse(keyword, in)) {
+            std::cerr << "Invalid camera setting " << keyword << std::endl;
+            return false;
+        }
+    }
+    if (const char *error = camera.check()) {
+        std::cerr << "Invalid camera: " << error << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//[comment]
+// Load the scene to render: one of the scenes of buildScene() if name is one of
+// them, otherwise a text or binary scene file (binary files are told apart by
+// their magic number). Returns false, after printing why, if it fails.
+//[/comment]
+template<typename Material>
+bool loadScene(const std::string &name, typename Material::Library &library, Scene<Material> &scene)
+{
+    scene = Scene<Material>();
+    if (buildScene<Material>(name, library, scene.spheres)) return true;
+    std::ifstream file(name.c_str(), std::ios::binary);
+    if (!file) {
+        std::cerr << "Unknown scene: " << name << std::endl;
+        return false;
+    }
+    char magic[sizeof(SCENE_MAGIC)] = { 0 };
+    file.read(magic, sizeof(magic));
+    file.close();
+    if (!memcmp(magic, SCENE_MAGIC, sizeof(magic))) return loadBinaryScene<Material>(name, library, scene);
+    return loadTextScene<Material>(name, library, scene);
+}
+
+#endif
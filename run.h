@@ -0,0 +1,338 @@
+//[comment]
+// The command line of the programs, see run().
+//[/comment]
+#ifndef RAYTRACER_RUN_H
+#define RAYTRACER_RUN_H
+
+#include "raytracer.h"
+#include "offload.h"
+#include "network.h"
+#include "benchmark.h"
+
+//[comment]
+// The main function of the programs, rendering with the materials of Material
+// from library (which also parses the command line options of the materials),
+// program being the name of the program. It creates the scene (see
+// buildScene(), --scene NAME picks one of the generated scenes or loads a scene
+// file, see loadScene()). Then, once the scene description is complete
+// we render that scene, by calling the render() function.
+// The number of render threads can be set with --threads N (it defaults to the
+// number of hardware threads) and the intersection kernel with --simd (it
+// defaults to the widest one the CPU supports). Primary rays are traced in
+// packets of 4x4 rays, --packet 8 uses 8x8 packets and --packet 1 single rays.
+// --wavefront traces the rays of every tile a bounce at a time, sorted by
+// direction and origin (see renderWavefront()), instead of pixel by pixel.
+// --accelerator bvh|grid picks the acceleration structure of the frames and
+// animations instead of letting the scene choose (see useGrid()); progressive
+// renders, previews and workers always use a BVH.
+// --offload renders the image on the GPU in builds with -DRAYTRACER_OFFLOAD
+// (see renderOffload()), and on the CPU if there is no GPU.
+// Reflection and refraction rays whose weight is below --cutoff X (0.001 by
+// default, 0 traces all the rays) play Russian roulette.
+// The image is saved to --output FILE (./untitled.ppm by default), as a PNG
+// file if its name ends with .png or if --format png is given.
+// --bench SCENES renders a comma separated list of scenes (or "all" of them)
+// --iterations N times (5 by default) and prints the timings as JSON instead.
+// With --heatmap, builds with -DRAYTRACER_STATS also save heatmaps of the cost
+// of the pixels next to the image (see writeHeatmaps()).
+// --progressive N renders up to N antialiasing passes instead (see
+// renderProgressive()), --threshold X sets the error at which a pixel stops
+// getting samples and --time-budget S stops after S seconds. --denoise
+// denoises the last pass (see Denoiser).
+// --save-scene FILE saves the scene and its BVH to a binary scene file, which
+// loads much faster than a text one, instead of rendering it.
+// The camera of the scene (see Camera) can be changed with --eye X,Y,Z,
+// --look-at X,Y,Z, --up X,Y,Z, --fov DEGREES, --resolution WIDTHxHEIGHT and
+// --crop X0,Y0,X1,Y1, which renders only that region of the image.
+// --frames FIRST-LAST renders the frames of an animation of the scene (see
+// renderAnimation()).
+// --serve PORT makes the program a worker rendering tiles for coordinators
+// (the generated scenes, and the scene files of --scene-dir DIR), and --workers HOST:PORT,... renders the image with such workers instead of
+// rendering it here (see renderDistributed()).
+// --preview PORT keeps the scene in memory and renders it again as a viewer
+// started with --view HOST:PORT edits it (see preview()).
+// The regression tests use --compare GOLDEN, which compares the image with a
+// golden image (see compareImages()), --min-psnr DB and --max-error N setting
+// the tolerance, and --microbench, which times the inner loops instead of
+// rendering (see microbenchmark()). --baseline FILE compares the throughputs
+// of --bench or --microbench with the ones of an earlier run, and fails if
+// one of them is more than --max-regression X below it (see checkBaseline()).
+// The program returns 1 if a check fails.
+//[/comment]
+template<typename Material>
+int run(int argc, char **argv, const char *program, typename Material::Library &library)
+{
+    RenderOptions options;
+    options.numThreads = std::max(1u, std::thread::hardware_concurrency());
+    options.kernel = selectIntersectKernel("auto");
+    bool formatSet = false;
+    std::string scene = "default";
+    std::vector<std::string> benchScenes;
+    std::string saveScene;
+    unsigned iterations = 5, firstFrame = 0, lastFrame = 0, servePort = 0, previewPort = 0;
+    bool animation = false;
+    std::vector<std::string> workers;
+    std::string viewAddress;
+    std::string golden, baseline, sceneDir;
+    double minPsnr = 40, maxRegression = 0.2;
+    unsigned maxError = 2;
+    bool microbench = false;
+    bool valid = true;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            options.numThreads = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--simd") && i + 1 < argc) {
+            options.kernel = selectIntersectKernel(argv[++i]);
+            if (!options.kernel) {
+                std::cerr << "Unsupported intersection kernel: " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--packet") && i + 1 < argc) {
+            options.packetSize = atoi(argv[++i]);
+            if (options.packetSize != 1 && options.packetSize != 4 && options.packetSize != 8) {
+                std::cerr << "Packet size must be 1, 4 or 8" << std::endl;
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--wavefront")) {
+            options.wavefront = true;
+        }
+        else if (!strcmp(argv[i], "--accelerator") && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name == "auto") options.accelerator = ACCELERATOR_AUTO;
+            else if (name == "bvh") options.accelerator = ACCELERATOR_BVH;
+            else if (name == "grid") options.accelerator = ACCELERATOR_GRID;
+            else {
+                std::cerr << "Unknown accelerator: " << name << std::endl;
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--cutoff") && i + 1 < argc) {
+            options.cutoff = std::max(0., atof(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+            options.output = argv[++i];
+            if (!formatSet) options.format = formatFromFilename(options.output);
+        }
+        else if (!strcmp(argv[i], "--format") && i + 1 < argc) {
+            ++i;
+            if (!strcmp(argv[i], "ppm")) options.format = PPM;
+            else if (!strcmp(argv[i], "png")) options.format = PNG;
+            else {
+                std::cerr << "Unsupported image format: " << argv[i] << std::endl;
+                return 1;
+            }
+            formatSet = true;
+        }
+        else if (!strcmp(argv[i], "--scene") && i + 1 < argc) {
+            scene = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--scene-dir") && i + 1 < argc) {
+            sceneDir = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--save-scene") && i + 1 < argc) {
+            saveScene = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--bench") && i + 1 < argc) {
+            std::string list = argv[++i];
+            if (list == "all") list = "default,spheres1k,spheres100k,spheres1m,reflective,transparent";
+            for (size_t start = 0, end; start <= list.size(); start = end + 1) {
+                end = std::min(list.find(',', start), list.size());
+                benchScenes.push_back(list.substr(start, end - start));
+            }
+        }
+        else if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+            iterations = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--microbench")) {
+            microbench = true;
+        }
+        else if (!strcmp(argv[i], "--baseline") && i + 1 < argc) {
+            baseline = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--max-regression") && i + 1 < argc) {
+            maxRegression = std::max(0., atof(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--compare") && i + 1 < argc) {
+            golden = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--min-psnr") && i + 1 < argc) {
+            minPsnr = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--max-error") && i + 1 < argc) {
+            maxError = std::max(0, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--offload")) {
+#ifndef RAYTRACER_OFFLOAD
+            std::cerr << "GPU offload needs a build with -DRAYTRACER_OFFLOAD and OpenMP (-fopenmp)" << std::endl;
+            return 1;
+#endif
+            options.offload = true;
+        }
+        else if (!strcmp(argv[i], "--heatmap")) {
+#ifndef RAYTRACER_STATS
+            std::cerr << "Heatmaps need a build with -DRAYTRACER_STATS" << std::endl;
+            return 1;
+#endif
+            options.heatmap = true;
+        }
+        else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            char end;
+            if (sscanf(argv[++i], "%u-%u%c", &firstFrame, &lastFrame, &end) != 2 || firstFrame > lastFrame) {
+                std::cerr << "Frames must be a range FIRST-LAST" << std::endl;
+                return 1;
+            }
+            animation = true;
+        }
+        else if ((!strcmp(argv[i], "--serve") || !strcmp(argv[i], "--workers") || !strcmp(argv[i], "--preview") ||
+            !strcmp(argv[i], "--view")) && i + 1 < argc) {
+#ifndef HAVE_SOCKETS
+            std::cerr << "Distributed rendering and previews are not supported on this platform" << std::endl;
+            return 1;
+#endif
+            if (!strcmp(argv[i], "--serve") || !strcmp(argv[i], "--preview")) {
+                unsigned &port = !strcmp(argv[i], "--serve") ? servePort : previewPort;
+                port = atoi(argv[++i]);
+                if (port == 0 || port > 65535) {
+                    std::cerr << "Invalid port: " << argv[i] << std::endl;
+                    return 1;
+                }
+                continue;
+            }
+            if (!strcmp(argv[i], "--view")) {
+                viewAddress = argv[++i];
+                continue;
+            }
+            std::string list = argv[++i];
+            for (size_t start = 0, end; start <= list.size(); start = end + 1) {
+                end = std::min(list.find(',', start), list.size());
+                workers.push_back(list.substr(start, end - start));
+            }
+        }
+        else if (!strcmp(argv[i], "--progressive") && i + 1 < argc) {
+            options.passes = std::max(0, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--threshold") && i + 1 < argc) {
+            options.threshold = std::max(0., atof(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--time-budget") && i + 1 < argc) {
+            options.timeBudget = std::max(0., atof(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--denoise")) {
+            options.denoise = true;
+        }
+        else if ((!strcmp(argv[i], "--eye") || !strcmp(argv[i], "--look-at") || !strcmp(argv[i], "--up") ||
+            !strcmp(argv[i], "--fov") || !strcmp(argv[i], "--resolution") || !strcmp(argv[i], "--crop")) && i + 1 < argc) {
+            // turned into the settings of the scene files, applied once the scene is loaded
+            std::string keyword = argv[i] + 2, values = argv[++i];
+            if (keyword == "look-at") keyword = "lookat";
+            std::replace(values.begin(), values.end(), ',', ' ');
+            if (keyword == "resolution") std::replace(values.begin(), values.end(), 'x', ' ');
+            options.camera += keyword + " " + values + " ";
+        }
+        else if (library.parseOption(argc, argv, i, valid)) {
+            if (!valid) return 1;
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--threads N] [--simd auto|scalar|avx2|avx512] [--packet 1|4|8]"
+                " [--wavefront] [--accelerator auto|bvh|grid] [--cutoff X]" << Material::Library::usage() <<
+                " [--output FILE] [--format ppm|png] [--scene NAME] [--bench SCENES] [--iterations N]"
+                " [--heatmap] [--progressive N] [--threshold X] [--time-budget S] [--denoise] [--save-scene FILE]"
+                " [--eye X,Y,Z] [--look-at X,Y,Z] [--up X,Y,Z] [--fov DEGREES] [--resolution WIDTHxHEIGHT]"
+                " [--crop X0,Y0,X1,Y1] [--frames FIRST-LAST] [--serve PORT] [--scene-dir DIR] [--workers HOST:PORT,...]"
+                " [--preview PORT] [--view HOST:PORT] [--offload] [--compare GOLDEN] [--min-psnr DB]"
+                " [--max-error N] [--microbench] [--baseline FILE] [--max-regression X]" << std::endl;
+            return 1;
+        }
+    }
+    if (options.heatmap && options.passes) {
+        std::cerr << "--heatmap can't be used with --progressive" << std::endl;
+        return 1;
+    }
+    if (options.denoise && !options.passes) {
+        std::cerr << "--denoise needs --progressive" << std::endl;
+        return 1;
+    }
+    if (options.wavefront && (options.heatmap || options.passes)) {
+        std::cerr << "--wavefront can't be used with --heatmap or --progressive" << std::endl;
+        return 1;
+    }
+    if (animation && (options.heatmap || options.passes)) {
+        std::cerr << "--frames can't be used with --heatmap or --progressive" << std::endl;
+        return 1;
+    }
+    if ((!workers.empty() || previewPort || !viewAddress.empty()) &&
+        (animation || options.heatmap || options.passes || !benchScenes.empty() || !saveScene.empty())) {
+        std::cerr << "--workers, --preview and --view can only render a single image" << std::endl;
+        return 1;
+    }
+    if (options.offload && (animation || options.heatmap || options.passes || !benchScenes.empty() ||
+        !saveScene.empty() || servePort || previewPort || !workers.empty() || !viewAddress.empty())) {
+        std::cerr << "--offload can only render a single image" << std::endl;
+        return 1;
+    }
+    if (microbench && (!benchScenes.empty() || animation || !saveScene.empty() || servePort || previewPort ||
+        !workers.empty() || !viewAddress.empty())) {
+        std::cerr << "--microbench can't be used with --bench, --frames, --save-scene, --serve, --workers, --preview or --view" << std::endl;
+        return 1;
+    }
+    if (!baseline.empty() && benchScenes.empty() && !microbench) {
+        std::cerr << "--baseline needs --bench or --microbench" << std::endl;
+        return 1;
+    }
+    if (!golden.empty() && (animation || !benchScenes.empty() || microbench || !saveScene.empty() || servePort ||
+        previewPort || !viewAddress.empty())) {
+        std::cerr << "--compare can only check a single image" << std::endl;
+        return 1;
+    }
+    if (!golden.empty() && options.format != PPM) {
+        std::cerr << "--compare needs a PPM output" << std::endl;
+        return 1;
+    }
+    if (!sceneDir.empty() && !servePort) {
+        std::cerr << "--scene-dir needs --serve" << std::endl;
+        return 1;
+    }
+    library.setThreads(options.numThreads);
+    srand48(13);
+#ifdef HAVE_SOCKETS
+    if (servePort) return serve<Material>(servePort, options, library, sceneDir);
+    if (!workers.empty()) {
+        if (!renderDistributed(scene, options, workers)) return 1;
+        return golden.empty() || compareImages(options.output, golden, minPsnr, maxError) ? 0 : 1;
+    }
+    if (!viewAddress.empty()) return view(viewAddress, options) ? 0 : 1;
+#endif
+    if (!benchScenes.empty() || microbench) {
+        Throughputs results;
+        if (microbench ? !microbenchmark<Material>(iterations, options, library, program, results) :
+            !benchmark<Material>(benchScenes, iterations, options, library, program, results)) return 1;
+        return baseline.empty() || checkBaseline(baseline, results, maxRegression) ? 0 : 1;
+    }
+    Scene<Material> loaded;
+    if (!loadScene<Material>(scene, library, loaded) || !setCamera(options.camera, loaded.camera)) return 1;
+    if (!saveScene.empty()) {
+        BVH<Material> bvh = loaded.nodes.empty() ? BVH<Material>(loaded.spheres, options.kernel) :
+            BVH<Material>(loaded.spheres, options.kernel, loaded.nodes, loaded.slots);
+        if (!saveBinaryScene(saveScene, loaded.spheres, &bvh)) {
+            std::cerr << "Can't write scene file " << saveScene << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+#ifdef HAVE_SOCKETS
+    if (previewPort) return preview(previewPort, loaded, options);
+#endif
+    WorkerPool pool(options.numThreads);
+    if (animation) {
+        return renderAnimation(loaded, options, pool, firstFrame, lastFrame) ? 0 : 1;
+    }
+    Framebuffer framebuffer;
+    if (!render(loaded, options, pool, framebuffer)) return 1;
+
+    return golden.empty() || compareImages(options.output, golden, minPsnr, maxError) ? 0 : 1;
+}
+
+#endif
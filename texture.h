@@ -0,0 +1,745 @@
+// Textured spheres for angad_sphere_texture.cpp: PPM textures, mipmapped and
+// filtered with the ray footprint, and the material policy using them (see
+// FlatMaterial in raytracer.h for the interface of a material).
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <cctype>
+#include <condition_variable>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+
+#include "raytracer.h"
+
+// Compression of the texture tiles kept in memory (see TextureTileCache): a
+// byte oriented LZ77 in the format of LZ4 blocks. A sequence is a token (the
+// number of literals in the high nibble, the length of the match minus 4 in the
+// low one, 15 meaning more length bytes follow), the literals, and the match as
+// a 2-byte offset back into the output; the last sequence only has literals.
+// The texels are stored as RGB8 with each channel minus the one of the texel
+// on their left, which turns smooth gradients into runs the matches pick up.
+inline void putLength(std::vector<unsigned char> &out, size_t n)
+{
+    for (; n >= 255; n -= 255) out.push_back(255);
+    out.push_back((unsigned char)n);
+}
+
+inline void compressLZ(const unsigned char *src, size_t size, std::vector<unsigned char> &out)
+{
+    const size_t MIN_MATCH = 4, HASH_BITS = 12;
+    std::vector<int> table(1 << HASH_BITS, -1);
+    auto hash = [&](size_t i) {
+        uint32_t v;
+        memcpy(&v, src + i, 4);
+        return (v * 2654435761u) >> (32 - HASH_BITS);
+    };
+    size_t literals = 0, i = 0;
+    auto emit = [&](size_t matchLength, size_t offset) {
+        size_t start = i - literals;
+        size_t extra = matchLength ? matchLength - MIN_MATCH : 0;
+        out.push_back((unsigned char)(std::min(literals, size_t(15)) << 4 | std::min(extra, size_t(15))));
+        if (literals >= 15) putLength(out, literals - 15);
+        out.insert(out.end(), src + start, src + i);
+        if (!matchLength) return;
+        out.push_back((unsigned char)offset), out.push_back((unsigned char)(offset >> 8));
+        if (extra >= 15) putLength(out, extra - 15);
+    };
+    while (i + MIN_MATCH <= size) {
+        uint32_t h = hash(i);
+        int candidate = table[h];
+        table[h] = int(i);
+        if (candidate >= 0 && i - candidate <= 65535 && !memcmp(src + candidate, src + i, MIN_MATCH)) {
+            size_t length = MIN_MATCH;
+            while (i + length < size && src[candidate + length] == src[i + length]) ++length;
+            emit(length, i - candidate);
+            i += length, literals = 0;
+            continue;
+        }
+        ++i, ++literals;
+    }
+    literals += size - i, i = size;
+    emit(0, 0);
+}
+
+inline void decompressLZ(const unsigned char *src, size_t size, unsigned char *dst)
+{
+    const unsigned char *end = src + size;
+    while (src < end) {
+        unsigned token = *src++;
+        size_t literals = token >> 4, length = token & 15;
+        if (literals == 15) do literals += *src; while (*src++ == 255);
+        memcpy(dst, src, literals);
+        dst += literals, src += literals;
+        if (src == end) break;
+        size_t offset = src[0] | src[1] << 8;
+        src += 2;
+        if (length == 15) do length += *src; while (*src++ == 255);
+        // the match may overlap the bytes it produces
+        for (size_t k = 0; k < length + 4; ++k, ++dst) *dst = dst[-std::ptrdiff_t(offset)];
+    }
+}
+
+// Decoded tiles of the textures kept compressed, when the memory of decoded
+// textures is limited (--texture-memory). Every tile has a key of its own, and
+// the cache holds the most recently used ones in a fixed number of slots of
+// 32x32 RGBA8 texels, as many as fit in its bytes (at least TILE_BYTES). The
+// render threads all sample the textures, so the cache is split into up to
+// SHARDS shards by key, each with its own lock and LRU list; the texels are
+// copied out under the lock, so a tile can be evicted as soon as the lookup is
+// over.
+class TextureTileCache
+{
+public:
+    enum { TILE_TEXELS = 32 * 32, TILE_BYTES = TILE_TEXELS * sizeof(uint32_t), SHARDS = 16 };
+    TextureTileCache(size_t bytes) :
+        shards(std::max(size_t(1), std::min(size_t(SHARDS), bytes / TILE_BYTES))), nextKey(0)
+    {
+        // small caches get fewer shards rather than more memory than they were given
+        size_t slots = std::max(size_t(1), bytes / TILE_BYTES / shards.size());
+        for (unsigned k = 0; k < shards.size(); ++k) {
+            Shard &shard = shards[k];
+            shard.texels.resize(slots * TILE_TEXELS);
+            shard.keys.assign(slots, ~uint64_t(0));
+            shard.prev.resize(slots), shard.next.resize(slots);
+            for (unsigned i = 0; i < slots; ++i) shard.prev[i] = i ? i - 1 : slots - 1, shard.next[i] = (i + 1) % slots;
+        }
+    }
+
+    // first key of count new tiles
+    uint64_t reserve(size_t count)
+    {
+        std::lock_guard<std::mutex> guard(keysLock);
+        uint64_t first = nextKey;
+        nextKey += count;
+        return first;
+    }
+
+    // copy the texels at offsets[0..n) of tile key to out, decode(texels)
+    // filling the slot with the tile first if it isn't in the cache
+    template<typename Decode>
+    void read(uint64_t key, const Decode &decode, const unsigned *offsets, unsigned n, uint32_t *out)
+    {
+        Shard &shard = shards[((key * 0x9e3779b97f4a7c15ull) >> 32) % shards.size()];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        unsigned slot;
+        auto found = shard.slots.find(key);
+        if (found != shard.slots.end()) {
+            slot = found->second;
+            ++shard.hits;
+            if (slot != shard.head) {
+                unlink(shard, slot);
+                link(shard, slot);
+            }
+        }
+        else {
+            // the least recently used slot is the one before the head
+            slot = shard.prev[shard.head];
+            if (shard.keys[slot] != ~uint64_t(0)) shard.slots.erase(shard.keys[slot]), ++shard.evictions;
+            shard.keys[slot] = key;
+            shard.slots[key] = slot;
+            shard.head = slot;
+            ++shard.misses;
+            decode(&shard.texels[size_t(slot) * TILE_TEXELS]);
+        }
+        const uint32_t *texels = &shard.texels[size_t(slot) * TILE_TEXELS];
+        for (unsigned i = 0; i < n; ++i) out[i] = texels[offsets[i]];
+    }
+
+    size_t capacity() const { return shards.size() * shards[0].keys.size() * TILE_BYTES; }
+    void counters(uint64_t &hits, uint64_t &misses, uint64_t &evictions)
+    {
+        hits = misses = evictions = 0;
+        for (unsigned k = 0; k < shards.size(); ++k) {
+            std::lock_guard<std::mutex> guard(shards[k].lock);
+            hits += shards[k].hits, misses += shards[k].misses, evictions += shards[k].evictions;
+        }
+    }
+    void resetCounters()
+    {
+        for (unsigned k = 0; k < shards.size(); ++k) {
+            std::lock_guard<std::mutex> guard(shards[k].lock);
+            shards[k].hits = shards[k].misses = shards[k].evictions = 0;
+        }
+    }
+
+private:
+    // The slots of a shard form a circular list from the most recently used
+    // one (head) to the least recently used one (before it)
+    struct Shard
+    {
+        std::mutex lock;
+        std::unordered_map<uint64_t, unsigned> slots;
+        std::vector<uint32_t, AlignedAllocator<uint32_t> > texels;
+        std::vector<uint64_t> keys;
+        std::vector<unsigned> prev, next;
+        unsigned head;
+        uint64_t hits, misses, evictions;
+        Shard() : head(0), hits(0), misses(0), evictions(0) {}
+    };
+    std::vector<Shard> shards;
+    std::mutex keysLock;
+    uint64_t nextKey;
+
+    static void unlink(Shard &shard, unsigned slot)
+    {
+        shard.next[shard.prev[slot]] = shard.next[slot];
+        shard.prev[shard.next[slot]] = shard.prev[slot];
+    }
+    // insert slot before the head and make it the head
+    static void link(Shard &shard, unsigned slot)
+    {
+        unsigned head = shard.head, last = shard.prev[head];
+        shard.prev[slot] = last, shard.next[slot] = head;
+        shard.next[last] = slot, shard.prev[head] = slot;
+        shard.head = slot;
+    }
+};
+
+// Texels are packed as RGBA8 in one aligned buffer per mip level, either row by
+// row or in 32x32 tiles storing their texels in Morton (Z) order, so that texels
+// close to each other in the image are also close in memory. Textures loaded
+// for a TextureTileCache are instead kept as compressed 32x32 tiles, which
+// sample() decodes through the cache.
+//
+// With the TRILINEAR filter, sample() picks the mip level matching the size of
+// the ray footprint and blends bilinear lookups in the two closest levels, so a
+// small or distant sphere reads a few texels from a small level (which stays in
+// cache) instead of aliasing over random texels of the full resolution image.
+class Texture
+{
+public:
+    enum Layout { LINEAR, MORTON };
+    enum Filter { NEAREST, TRILINEAR };
+    int width, height;
+    float density;                          // texels per radian of the sphere, along the equator or a meridian
+
+    Texture(int w, int h, Layout layout, Filter f) :
+        width(w), height(h), density(std::max(w / float(2 * M_PI), h / float(M_PI))), filter(f)
+    {
+        levels.push_back(Level(w, h, layout));
+    }
+
+    // row y of level 0, as RGBA8 texels
+    void setRow(int y, const uint32_t *row)
+    {
+        levels[0].setRow(y, row);
+    }
+
+    // box filter each level down to 1x1, once level 0 has been loaded
+    void buildMipmaps()
+    {
+        if (filter == NEAREST) return;
+        while (levels.back().width > 1 || levels.back().height > 1) {
+            const Level &src = levels.back();
+            Level dst(std::max(1, src.width / 2), std::max(1, src.height / 2), src.layout);
+            for (int y = 0; y < dst.height; ++y) {
+                int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+                for (int x = 0; x < dst.width; ++x) {
+                    int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+                    uint32_t a = src.texel(x0, y0), b = src.texel(x1, y0), c = src.texel(x0, y1), d = src.texel(x1, y1);
+                    unsigned char rgb[3];
+                    for (int k = 0; k < 3; ++k) {
+                        int shift = 8 * k;
+                        rgb[k] = ((a >> shift & 0xff) + (b >> shift & 0xff) + (c >> shift & 0xff) + (d >> shift & 0xff) + 2) / 4;
+                    }
+                    dst.set(x, y, rgb[0], rgb[1], rgb[2]);
+                }
+            }
+            levels.push_back(dst);
+        }
+    }
+
+    // memory used by the texels of all the levels, compressed or not
+    size_t bytes() const
+    {
+        size_t sum = 0;
+        for (size_t l = 0; l < levels.size(); ++l) sum += levels[l].texels.size() * sizeof(uint32_t) + levels[l].packed.size();
+        return sum;
+    }
+
+    // compress the levels into tiles decoded by cache, and free their texels
+    void page(TextureTileCache *cache)
+    {
+        for (size_t l = 0; l < levels.size(); ++l) levels[l].page(cache);
+    }
+
+    // footprint is the size of the ray footprint in level 0 texels
+    Vec3f sample(float u, float v, float footprint) const
+    {
+        if (filter == NEAREST) {
+            int x = std::min(width - 1, std::max(0, static_cast<int>(u * width)));
+            int y = std::min(height - 1, std::max(0, static_cast<int>(v * height)));
+            return levels[0].fetch(x, y);
+        }
+        float lod = footprint > 1 ? std::min(log2f(footprint), float(levels.size() - 1)) : 0;
+        unsigned l = static_cast<unsigned>(lod);
+        float f = lod - l;
+        Vec3f color = levels[l].bilinear(u, v);
+        if (f > 0 && l + 1 < levels.size()) color = color * (1 - f) + levels[l + 1].bilinear(u, v) * f;
+        return color;
+    }
+
+private:
+    struct Level
+    {
+        int width, height;
+        Layout layout;
+        int tilesX;
+        std::vector<uint32_t, AlignedAllocator<uint32_t> > texels;
+        // once paged: the compressed tiles, tile t being the bytes
+        // [tileStarts[t], tileStarts[t + 1]) of packed, with key firstKey + t
+        TextureTileCache *cache;
+        std::vector<unsigned char> packed;
+        std::vector<uint32_t> tileStarts;
+        uint64_t firstKey;
+
+        Level(int w, int h, Layout l) : width(w), height(h), layout(l), tilesX((w + 31) / 32), cache(NULL), firstKey(0)
+        {
+            if (layout == LINEAR) texels.resize(size_t(width) * height);
+            else texels.resize(size_t(tilesX) * ((height + 31) / 32) * 1024);
+        }
+        void set(int x, int y, unsigned char r, unsigned char g, unsigned char b)
+        {
+            texels[offset(x, y)] = r | g << 8 | b << 16 | 0xffu << 24;
+        }
+        void setRow(int y, const uint32_t *row)
+        {
+            if (layout == LINEAR) std::copy(row, row + width, &texels[size_t(y) * width]);
+            else for (int x = 0; x < width; ++x) texels[offset(x, y)] = row[x];
+        }
+        uint32_t texel(int x, int y) const { return texels[offset(x, y)]; }
+        static Vec3f unpack(uint32_t t)
+        {
+            static const float *unorm = unormTable();
+            return Vec3f(unorm[t & 0xff], unorm[t >> 8 & 0xff], unorm[t >> 16 & 0xff]);
+        }
+        Vec3f fetch(int x, int y) const
+        {
+            uint32_t t;
+            fetch(&x, &y, 1, &t);
+            return unpack(t);
+        }
+        // the n texels (xs[i], ys[i]), with one cache lookup per tile
+        void fetch(const int *xs, const int *ys, unsigned n, uint32_t *out) const
+        {
+            if (!cache) {
+                for (unsigned i = 0; i < n; ++i) out[i] = texel(xs[i], ys[i]);
+                return;
+            }
+            for (unsigned i = 0; i < n; ) {
+                unsigned tile = (ys[i] >> 5) * tilesX + (xs[i] >> 5), offsets[4], count = 0, j = i;
+                for (; j < n && count < 4 && unsigned((ys[j] >> 5) * tilesX + (xs[j] >> 5)) == tile; ++j)
+                    offsets[count++] = (ys[j] & 31) * 32 + (xs[j] & 31);
+                cache->read(firstKey + tile, [&](uint32_t *slot) { decode(tile, slot); }, offsets, count, out + i);
+                i = j;
+            }
+        }
+        // u wraps around the sphere, v is clamped at the poles
+        Vec3f bilinear(float u, float v) const
+        {
+            float fx = u * width - 0.5f, fy = v * height - 0.5f;
+            float x0 = std::floor(fx), y0 = std::floor(fy);
+            float tx = fx - x0, ty = fy - y0;
+            int xa = (static_cast<int>(x0) % width + width) % width, xb = (xa + 1) % width;
+            int ya = std::min(height - 1, std::max(0, static_cast<int>(y0)));
+            int yb = std::min(height - 1, std::max(0, static_cast<int>(y0) + 1));
+            const int xs[4] = { xa, xb, xa, xb }, ys[4] = { ya, ya, yb, yb };
+            uint32_t t[4];
+            fetch(xs, ys, 4, t);
+            return (unpack(t[0]) * (1 - tx) + unpack(t[1]) * tx) * (1 - ty) +
+                (unpack(t[2]) * (1 - tx) + unpack(t[3]) * tx) * ty;
+        }
+        void page(TextureTileCache *tileCache)
+        {
+            int tilesY = (height + 31) / 32;
+            std::vector<unsigned char> rgb;
+            tileStarts.assign(1, 0);
+            for (int ty = 0; ty < tilesY; ++ty) {
+                for (int tx = 0; tx < tilesX; ++tx) {
+                    int w = std::min(32, width - 32 * tx), h = std::min(32, height - 32 * ty);
+                    rgb.clear();
+                    for (int y = 0; y < h; ++y) {
+                        uint32_t left = 0;
+                        for (int x = 0; x < w; ++x) {
+                            uint32_t t = texel(32 * tx + x, 32 * ty + y);
+                            for (int k = 0; k < 3; ++k) rgb.push_back((unsigned char)((t >> 8 * k) - (left >> 8 * k)));
+                            left = t;
+                        }
+                    }
+                    compressLZ(rgb.data(), rgb.size(), packed);
+                    tileStarts.push_back(packed.size());
+                }
+            }
+            packed.shrink_to_fit();
+            std::vector<uint32_t, AlignedAllocator<uint32_t> >().swap(texels);
+            firstKey = tileCache->reserve(tileStarts.size() - 1);
+            cache = tileCache;
+        }
+        void decode(unsigned tile, uint32_t *slot) const
+        {
+            int tx = tile % tilesX, ty = tile / tilesX;
+            int w = std::min(32, width - 32 * tx), h = std::min(32, height - 32 * ty);
+            unsigned char rgb[32 * 32 * 3];
+            decompressLZ(&packed[tileStarts[tile]], tileStarts[tile + 1] - tileStarts[tile], rgb);
+            const unsigned char *p = rgb;
+            for (int y = 0; y < h; ++y) {
+                unsigned char r = 0, g = 0, b = 0;
+                for (int x = 0; x < w; ++x, p += 3) {
+                    r += p[0], g += p[1], b += p[2];
+                    slot[y * 32 + x] = r | g << 8 | b << 16 | 0xffu << 24;
+                }
+            }
+        }
+        size_t offset(int x, int y) const
+        {
+            if (layout == LINEAR) return size_t(y) * width + x;
+            return (size_t(y >> 5) * tilesX + (x >> 5)) * 1024 + (spread(x & 31) | spread(y & 31) << 1);
+        }
+    };
+    Filter filter;
+    std::vector<Level> levels;
+
+    static unsigned spread(unsigned v)
+    {
+        v = (v | v << 4) & 0x0f0f;
+        v = (v | v << 2) & 0x3333;
+        v = (v | v << 1) & 0x5555;
+        return v;
+    }
+    // i / 255 for 8-bit channels, the same values loadTexture() used to store
+    static const float* unormTable()
+    {
+        static float table[256];
+        for (int i = 0; i < 256; ++i) table[i] = i / 255.0f;
+        return table;
+    }
+};
+
+// next number of a PPM header, skipping whitespace and comments
+inline bool parseHeaderValue(const unsigned char *&p, const unsigned char *end, int &value)
+{
+    for (;;) {
+        while (p < end && isspace(*p)) ++p;
+        if (p == end || *p != '#') break;
+        while (p < end && *p != '\n') ++p;
+    }
+    if (p == end || !isdigit(*p)) return false;
+    long v = 0;
+    for (; p < end && isdigit(*p); ++p) {
+        v = v * 10 + (*p - '0');
+        if (v > std::numeric_limits<int>::max()) return false;
+    }
+    value = int(v);
+    return true;
+}
+
+// RGB8 to RGBA8 conversion of a row of texels
+inline void packRGB8(const unsigned char *src, uint32_t *dst, int width)
+{
+    for (int x = 0; x < width; ++x, src += 3)
+        dst[x] = src[0] | src[1] << 8 | src[2] << 16 | 0xffu << 24;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("ssse3")))
+inline void packRGB8SSSE3(const unsigned char *src, uint32_t *dst, int width)
+{
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    int x = 0;
+    // 4 texels per iteration, but each load reads 16 bytes: stop early enough
+    // not to read past the end of the row
+    for (; x + 6 <= width; x += 4) {
+        __m128i rgb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_or_si128(_mm_shuffle_epi8(rgb, shuffle), alpha));
+    }
+    packRGB8(src + 3 * x, dst + x, width - x);
+}
+#endif
+
+// any maxVal other than 255: the channels are rescaled to 8 bits, and use two
+// bytes (most significant first) when maxVal > 255
+inline void packRGBScaled(const unsigned char *src, uint32_t *dst, int width, int maxVal)
+{
+    int bytes = maxVal > 255 ? 2 : 1;
+    for (int x = 0; x < width; ++x) {
+        uint32_t texel = 0xffu << 24;
+        for (int k = 0; k < 3; ++k, src += bytes) {
+            uint32_t v = bytes == 2 ? (src[0] << 8 | src[1]) : src[0];
+            texel |= (std::min(v, uint32_t(maxVal)) * 255 + maxVal / 2) / maxVal << 8 * k;
+        }
+        dst[x] = texel;
+    }
+}
+
+// load a PPM texture, kept compressed for tiles if not NULL. Returns NULL,
+// with the reason in error, if the file can't be read.
+inline std::shared_ptr<Texture> loadTexture(const std::string &filename, Texture::Layout layout, Texture::Filter filter,
+    TextureTileCache *tiles, std::string &error) {
+    MappedFile file(filename);
+    if (!file.data) {
+        error = "Unable to open texture file: " + filename;
+        return NULL;
+    }
+    const unsigned char *p = file.data, *end = file.data + file.size;
+    if (file.size < 2 || p[0] != 'P' || p[1] != '6') {
+        error = "Invalid PPM file format: " + filename;
+        return NULL;
+    }
+    p += 2;
+    int width = 0, height = 0, maxVal = 0;
+    if (!parseHeaderValue(p, end, width) || !parseHeaderValue(p, end, height) || !parseHeaderValue(p, end, maxVal) ||
+        p == end || !isspace(*p++) || width <= 0 || height <= 0 || maxVal <= 0 || maxVal > 65535) {
+        error = "Invalid PPM header: " + filename;
+        return NULL;
+    }
+    size_t rowBytes = size_t(width) * 3 * (maxVal > 255 ? 2 : 1);
+    if (size_t(end - p) / rowBytes < size_t(height)) {
+        error = "Truncated PPM file: " + filename;
+        return NULL;
+    }
+
+    // the texels are converted straight from the mapped file
+    void (*pack8)(const unsigned char *, uint32_t *, int) = packRGB8;
+#ifdef HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("ssse3")) pack8 = packRGB8SSSE3;
+#endif
+    std::shared_ptr<Texture> texture = std::make_shared<Texture>(width, height, layout, filter);
+    std::vector<uint32_t> row(width);
+    for (int y = 0; y < height; ++y, p += rowBytes) {
+        if (maxVal == 255) pack8(p, row.data(), width);
+        else packRGBScaled(p, row.data(), width, maxVal);
+        texture->setRow(y, row.data());
+    }
+    texture->buildMipmaps();
+    if (tiles) texture->page(tiles);
+    return texture;
+}
+
+// A texture file loaded in the background by a TextureCache. The spheres get
+// it from the start, and the first sample which needs it waits until it is
+// loaded, so the pixels which don't see it are traced meanwhile. get() is
+// NULL if the file couldn't be loaded.
+class TextureFile
+{
+public:
+    const std::string filename;
+
+    TextureFile(const std::string &name) : filename(name), loaded(false) {}
+
+    const Texture* get() const
+    {
+        if (!loaded.load(std::memory_order_acquire)) {
+            std::unique_lock<std::mutex> guard(lock);
+            done.wait(guard, [&]() { return loaded.load(std::memory_order_relaxed); });
+        }
+        return texture.get();
+    }
+
+    void set(const std::shared_ptr<const Texture> &t)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        texture = t;
+        loaded.store(true, std::memory_order_release);
+        done.notify_all();
+    }
+
+private:
+    std::shared_ptr<const Texture> texture;
+    std::atomic<bool> loaded;
+    mutable std::mutex lock;
+    mutable std::condition_variable done;
+};
+
+class TextureCache;
+
+// The color of a sphere is read from its texture, if it has one, with spherical
+// (u, v) coordinates; the ray footprint picks the mip level. The texture is
+// owned by the TextureCache it comes from, so the material (and the sphere) is
+// a plain record. Spheres whose texture failed to load keep their surface
+// color.
+class TexturedMaterial
+{
+public:
+    enum { TEXTURED = 1 };
+    typedef TextureCache Library;
+
+    TexturedMaterial(const TextureFile *t = NULL) : file(t), invRadius(0) {}
+
+    void bind(float radius) { invRadius = 1 / radius; }
+
+    // footprint is the width of the ray footprint on the surface
+    Vec3f color(const Vec3f &surfaceColor, const Vec3f &hit, float footprint) const
+    {
+        const Texture *texture = file ? file->get() : NULL;
+        if (!texture) return surfaceColor;
+        float u = Math::atan2(hit.z, hit.x) * float(0.5 / M_PI) + 0.5f;
+        float v = Math::acos(std::min(1.f, std::max(-1.f, hit.y * invRadius))) * float(1 / M_PI);
+        // texels per unit length on the surface
+        float texelDensity = texture->density * invRadius;
+        return texture->sample(u, v, footprint * texelDensity);
+    }
+
+    float curvature() const { return invRadius; }
+    std::string textureFile() const { return file ? file->filename : std::string(); }
+
+private:
+    const TextureFile *file;
+    float invRadius;
+};
+
+// Every texture file is loaded once and shared by all the spheres using it. The
+// textures live as long as the cache, which must outlive the scenes using them.
+// They are loaded in the background, in parallel by as many loader threads as
+// there are render threads (see setThreads()), while the rest of the scene is
+// set up and traced (see TextureFile). The loaders are threads of their own
+// rather than jobs of the WorkerPool, whose threads run one frame at a time
+// and would only start the loads once the frame needing them is over. A file which
+// can't be loaded is reported, and its spheres keep their surface color.
+// The layout and filter of the textures are set with --texture-layout and
+// --texture-filter. With --texture-memory MB, the textures are kept compressed
+// and at most MB megabytes of their tiles are decoded at a time (see
+// TextureTileCache).
+class TextureCache
+{
+public:
+    TextureCache() : layout(Texture::LINEAR), filter(Texture::TRILINEAR), memory(0), bytes(0), failed(0), threads(1),
+        stopping(false) {}
+    ~TextureCache()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < loaders.size(); ++i) loaders[i].join();
+    }
+
+    TexturedMaterial get(const std::string &filename)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::unique_ptr<TextureFile> &file = textures[filename];
+        if (!file) {
+            if (memory && !tiles) tiles.reset(new TextureTileCache(memory));
+            if (loaders.empty()) {
+                for (unsigned i = 0; i < threads; ++i)
+                    loaders.push_back(std::thread(&TextureCache::load, this));
+            }
+            file.reset(new TextureFile(filename));
+            pending.push_back(file.get());
+            wake.notify_one();
+        }
+        return TexturedMaterial(file.get());
+    }
+
+    // the texture memory and the tile cache counters since the last reset, as
+    // the JSON fields of the benchmark (see benchmark())
+    std::string stats()
+    {
+        char buffer[256];
+        std::lock_guard<std::mutex> guard(lock);
+        if (!tiles) {
+            snprintf(buffer, sizeof(buffer), "\"textures\": {\"files\": %zu, \"bytes\": %zu, \"failed\": %zu}",
+                textures.size(), bytes, failed);
+            return buffer;
+        }
+        uint64_t hits, misses, evictions;
+        tiles->counters(hits, misses, evictions);
+        snprintf(buffer, sizeof(buffer), "\"textures\": {\"files\": %zu, \"bytes\": %zu, \"failed\": %zu, "
+            "\"cacheBytes\": %zu, \"hits\": %llu, \"misses\": %llu, \"evictions\": %llu}", textures.size(), bytes,
+            failed, tiles->capacity(), (unsigned long long)hits, (unsigned long long)misses, (unsigned long long)evictions);
+        return buffer;
+    }
+    void resetStats()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (tiles) tiles->resetCounters();
+    }
+    // number of loader threads, the number of render threads (--threads)
+    void setThreads(unsigned count)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        threads = std::max(1u, count);
+    }
+
+    bool parseOption(int argc, char **argv, int &i, bool &valid)
+    {
+        if (!strcmp(argv[i], "--texture-layout") && i + 1 < argc) {
+            ++i;
+            if (!strcmp(argv[i], "linear")) layout = Texture::LINEAR;
+            else if (!strcmp(argv[i], "morton")) layout = Texture::MORTON;
+            else {
+                std::cerr << "Texture layout must be linear or morton" << std::endl;
+                valid = false;
+            }
+            return true;
+        }
+        if (!strcmp(argv[i], "--texture-memory") && i + 1 < argc) {
+            char *end;
+            double megabytes = strtod(argv[++i], &end);
+            if (*end || !(megabytes > 0) || megabytes > 1 << 20) {
+                std::cerr << "Texture memory must be a positive number of megabytes" << std::endl;
+                valid = false;
+            }
+            else if (megabytes * (1 << 20) < TextureTileCache::TILE_BYTES) {
+                std::cerr << "Texture memory must hold at least one tile of " << TextureTileCache::TILE_BYTES <<
+                    " bytes" << std::endl;
+                valid = false;
+            }
+            else memory = size_t(megabytes * (1 << 20));
+            return true;
+        }
+        if (!strcmp(argv[i], "--texture-filter") && i + 1 < argc) {
+            ++i;
+            if (!strcmp(argv[i], "nearest")) filter = Texture::NEAREST;
+            else if (!strcmp(argv[i], "trilinear")) filter = Texture::TRILINEAR;
+            else {
+                std::cerr << "Texture filter must be nearest or trilinear" << std::endl;
+                valid = false;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    static const char* usage()
+    {
+        return " [--texture-layout linear|morton] [--texture-filter nearest|trilinear] [--texture-memory MB]";
+    }
+
+private:
+    Texture::Layout layout;
+    Texture::Filter filter;
+    size_t memory, bytes, failed;           // limit of the decoded tiles (0 for none), bytes of the textures loaded, files not loaded
+    unsigned threads;                       // loader threads started with the first texture
+    std::mutex lock;
+    std::condition_variable wake;
+    std::map<std::string, std::unique_ptr<TextureFile> > textures;
+    std::unique_ptr<TextureTileCache> tiles;
+    std::vector<std::thread> loaders;
+    std::deque<TextureFile*> pending;       // files to load, in the order the scenes asked for them
+    bool stopping;
+
+    // loader thread
+    void load()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            wake.wait(guard, [&]() { return stopping || !pending.empty(); });
+            if (stopping) return;
+            TextureFile *file = pending.front();
+            pending.pop_front();
+            guard.unlock();
+            std::string error;
+            std::shared_ptr<Texture> texture = loadTexture(file->filename, layout, filter, tiles.get(), error);
+            if (!error.empty()) std::cerr << error << ", using the surface color" << std::endl;
+            file->set(texture);
+            guard.lock();
+            if (texture) bytes += texture->bytes();
+            else ++failed;
+        }
+    }
+};
+
+#endif